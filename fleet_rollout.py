@@ -0,0 +1,397 @@
+# This Python program updates the firmware or the wifi-settings file on
+# several ventilation controllers at once, and checks that each one is
+# healthy afterwards.
+#
+#   python fleet_rollout.py firmware inventory.txt build/fw/main.vota
+#   python fleet_rollout.py settings inventory.txt wifi-settings-file
+#   python fleet_rollout.py firmware --emulate 20 --base old/main.bin build/fw/main.bin
+#
+# The inventory has one device per line: a name and a board_id, separated
+# by spaces. Lines beginning with '#' are ignored. All of the devices must
+# have the update_secret in remote_picotool.cfg.
+#
+# Firmware may be a compressed or delta image (.vota, see ota_pack.py), or
+# main.bin, which is compressed before sending (or made into a delta image,
+# if --base gives the main.bin that is currently deployed). These are sent
+# using the OTA stream handler in fw/main.c. A .uf2 file is sent with
+# "remote_picotool.py ota" instead. Settings are sent with
+# "remote_picotool.py update_reboot".
+#
+# The first --canary devices are updated first, and the rollout stops if
+# any of them fails. The remaining devices are then updated, with up to
+# --concurrency devices at once. For each device:
+#
+#  1. the status snapshot is read, recording the boot_id, the firmware and
+#     settings CRCs and the manual mode (devices that already have the
+#     update are skipped); snapshots are read without ADC samples, so the
+#     samples waiting for temperature_copy.py are not taken;
+#  2. the update is sent, and the device reboots (the OTA activate request
+#     uses a connection of its own, which is then discarded, because older
+#     firmware reboots without replying);
+#  3. the snapshot is polled until the boot_id changes, and the uptime must
+#     show that the device restarted;
+#  4. the firmware or settings CRC must match the update;
+#  5. if the device was in a mode other than AUTO before the update (which
+#     is lost on reboot), the mode is restored with a "piv" command and
+#     checked. AUTO_DARK does not expire, so it is always restored. The
+#     end time of a timed manual mode cannot be restored: "piv" starts a new
+#     manual_timeout_s period, so the mode may last longer than it would
+#     have done. A timed mode that would have ended during the update is
+#     not restored. A mode this program does not know is reported, not restored.
+#
+# The time taken by each step is reported for each device.
+#
+# With --emulate N, the inventory is replaced by N emulated devices
+# (the stand-in devices from rpc_pool.py), so the whole process can be
+# tested without hardware. --emulate-faulty makes some of them keep their
+# old firmware after the update, and --emulate-silent makes them reboot
+# without replying to the OTA activate request.
+
+import argparse
+import asyncio
+import os
+import random
+import struct
+import sys
+import time
+import typing
+import zlib
+
+import ota_pack
+import rpc_pool
+import status_snapshot
+
+DEFAULT_CONCURRENCY = 8
+DEFAULT_CANARY = 1
+DEFAULT_REBOOT_TIMEOUT = 120.0
+POLL_PERIOD = 1.0
+MAX_BACKOFF = 2.0   # reconnect promptly after a reboot
+
+MANUAL_MODE_COMMANDS = {
+    "AUTO": "piv auto",
+    "AUTO_DARK": "piv dark",
+    "MANUAL_ON": "piv on",
+    "MANUAL_OFF": "piv off",
+    "MANUAL_BOOST": "piv boost",
+}
+NON_EXPIRING_MODES = {"AUTO", "AUTO_DARK"}     # as is_manual_mode() in fw/main.c
+
+class RolloutError(Exception):
+    pass
+
+class Update:
+    """What is to be sent, and the CRC that the device should report afterwards."""
+
+    def __init__(self, kind: str, path: str, base_path: typing.Optional[str]) -> None:
+        self.kind = kind
+        self.path = path
+        self.image = b""                # OTA image, if sent by the OTA stream handler
+        self.data = b""                 # settings file
+        self.expected_crc: typing.Optional[int] = None
+        with open(path, "rb") as fd:
+            data = fd.read()
+        if kind == "settings":
+            self.data = data
+            self.expected_crc = zlib.crc32(rpc_pool.settings_file(data))
+        elif path.endswith(".vota"):
+            self.image = data
+            (magic, version, flags, output_size, output_crc,
+                base_size, base_crc) = struct.unpack_from(ota_pack.HEADER_FORMAT, data, 0)
+            if magic != ota_pack.OTA_MAGIC:
+                raise RolloutError(f"{path} is not an OTA image")
+            self.expected_crc = output_crc
+        elif path.endswith(".uf2"):
+            # sent by remote_picotool; the CRC is known if main.bin is alongside
+            bin_path = os.path.splitext(path)[0] + ".bin"
+            if os.path.exists(bin_path):
+                with open(bin_path, "rb") as fd:
+                    self.expected_crc = zlib.crc32(fd.read())
+        else:
+            base = None
+            if base_path is not None:
+                with open(base_path, "rb") as fd:
+                    base = fd.read()
+            self.image = ota_pack.encode(data, base)
+            self.expected_crc = zlib.crc32(data)
+
+    def crc_field(self) -> str:
+        return "settings_crc" if self.kind == "settings" else "firmware_crc"
+
+class Target:
+    """A device in the rollout, and the results for it."""
+
+    def __init__(self, name: str, board_id: typing.Optional[str], device: rpc_pool.Device,
+                    stand_in: typing.Optional[rpc_pool.StandInDevice] = None) -> None:
+        self.name = name
+        self.board_id = board_id
+        self.device = device
+        self.stand_in = stand_in
+        self.result = "not attempted"
+        self.ok = False
+        self.timings: typing.Dict[str, float] = {}
+
+async def read_snapshot(target: Target) -> status_snapshot.Snapshot:
+    # A full snapshot, so that the version section is always present
+    # (without ADC samples, which would be taken from temperature_copy.py)
+    (result_data, result_value) = await target.device.get_status(
+                    status_snapshot.ID_GET_STATUS_HANDLER_PARAMETER, b"")
+    if result_value != 0:
+        raise RolloutError(f"status result value {result_value}")
+    return status_snapshot.decode(result_data)
+
+async def remote_picotool_command(target: Target, *args: str) -> None:
+    script = os.path.join(os.path.dirname(os.path.abspath(__file__)), "remote_picotool.py")
+    command = [sys.executable, script]
+    if target.board_id is not None:
+        command += ["--id", target.board_id]
+    process = await asyncio.create_subprocess_exec(*command, *args,
+                    stdout=asyncio.subprocess.PIPE, stderr=asyncio.subprocess.STDOUT)
+    (output, _) = await process.communicate()
+    if process.returncode != 0:
+        text = output.decode("utf-8", errors="ignore").strip()
+        raise RolloutError(f"remote_picotool {args[0]} failed: {text}")
+
+async def push(target: Target, update: Update, chunk_size: int) -> None:
+    if update.kind == "settings":
+        if target.stand_in is not None:
+            target.stand_in.update_settings(update.data)
+        else:
+            await remote_picotool_command(target, "update_reboot", update.path)
+        return
+    if len(update.image) == 0:
+        await remote_picotool_command(target, "ota", update.path)
+        return
+
+    handler_id = target.device.connector.first_user_handler + rpc_pool.OTA_STREAM_HANDLER
+
+    async def run(data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        if parameter != ota_pack.OTA_ACTIVATE:
+            return await target.device.run(handler_id, data=data, parameter=parameter)
+        # Older firmware reboots without replying, which would leave a pool connection
+        # waiting, so activation uses a connection of its own. upload_image limits the
+        # wait for a reply; the reboot is confirmed by wait_for_reboot in any case.
+        try:
+            connection = await asyncio.wait_for(target.device.connector.connect(), target.device.timeout)
+        except Exception as e:
+            raise rpc_pool.RpcError(f"unable to connect for activation: {e!r}")
+        try:
+            return await connection.run(handler_id, data=data, parameter=parameter)
+        except Exception:
+            return (b"", 0)     # connection lost as the device rebooted
+        finally:
+            await connection.close()
+
+    await ota_pack.upload_image(run, update.image, True, chunk_size, lambda text: None)
+
+async def wait_for_reboot(target: Target, boot_id: int, timeout: float) -> status_snapshot.Snapshot:
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        await asyncio.sleep(POLL_PERIOD)
+        try:
+            snapshot = await read_snapshot(target)
+        except (rpc_pool.RpcError, status_snapshot.SnapshotError):
+            continue    # still rebooting
+        if snapshot.boot_id != boot_id:
+            return snapshot
+    raise RolloutError("device did not restart")
+
+async def update_device(target: Target, update: Update, chunk_size: int,
+                        reboot_timeout: float, force: bool) -> None:
+    start_time = time.monotonic()
+    step_time = start_time
+
+    def step(name: str) -> None:
+        nonlocal step_time
+        now = time.monotonic()
+        target.timings[name] = now - step_time
+        step_time = now
+
+    try:
+        before = await read_snapshot(target)
+        if (before.version is None) or (before.status is None):
+            raise RolloutError("status snapshot has no version (firmware is too old)")
+        manual_mode = before.status["manual_mode"]
+        manual_remaining = before.status["manual_mode_end_s"] - before.uptime_s
+        check_time = time.monotonic()
+        if (not force) and (before.version[update.crc_field()] == update.expected_crc):
+            target.result = "already up to date"
+            target.ok = True
+            return
+        step("check")
+
+        push_time = time.monotonic()
+        await push(target, update, chunk_size)
+        step("push")
+
+        after = await wait_for_reboot(target, before.boot_id, reboot_timeout)
+        if after.uptime_s > (time.monotonic() - push_time + POLL_PERIOD):
+            raise RolloutError(f"uptime {after.uptime_s}s does not show a restart")
+        step("reboot")
+
+        if after.version is None:
+            raise RolloutError("no version after the update")
+        if update.expected_crc is not None:
+            actual_crc = after.version[update.crc_field()]
+            if actual_crc != update.expected_crc:
+                raise RolloutError(f"{update.crc_field()} is 0x{actual_crc:08x}, "
+                                   f"expected 0x{update.expected_crc:08x}")
+        result = "updated"
+        if (after.status is not None) and (after.status["manual_mode"] != manual_mode):
+            if manual_mode not in MANUAL_MODE_COMMANDS:
+                result = f"updated, but mode {manual_mode} is unknown and was not restored"
+            elif ((manual_mode in NON_EXPIRING_MODES)
+            or (manual_remaining > (time.monotonic() - check_time))):
+                # A timed mode gets a new manual_timeout_s period (see above)
+                if not await target.device.set_relays(MANUAL_MODE_COMMANDS[manual_mode]):
+                    raise RolloutError(f"unable to restore mode {manual_mode}")
+                after = await read_snapshot(target)
+                if (after.status is None) or (after.status["manual_mode"] != manual_mode):
+                    raise RolloutError(f"mode {manual_mode} was not restored")
+        step("verify")
+        target.result = result
+        target.ok = True
+    except (RolloutError, rpc_pool.RpcError, ota_pack.OtaError, status_snapshot.SnapshotError) as e:
+        target.result = f"FAILED: {e}"
+    finally:
+        target.timings["total"] = time.monotonic() - start_time
+
+async def rollout(targets: typing.List[Target], update: Update, concurrency: int, canary: int,
+                  chunk_size: int, reboot_timeout: float, force: bool) -> bool:
+    semaphore = asyncio.Semaphore(concurrency)
+
+    async def run_one(target: Target) -> None:
+        async with semaphore:
+            await update_device(target, update, chunk_size, reboot_timeout, force)
+            print(f"{target.name}: {target.result}", flush=True)
+
+    canaries = targets[:canary]
+    rest = targets[canary:]
+    if len(canaries) > 0:
+        print(f"Updating {len(canaries)} canary device(s)", flush=True)
+        await asyncio.gather(*[run_one(target) for target in canaries])
+        if not all(target.ok for target in canaries):
+            print("Canary failed: stopping the rollout", flush=True)
+            return False
+    if len(rest) > 0:
+        print(f"Updating {len(rest)} device(s), {concurrency} at a time", flush=True)
+        await asyncio.gather(*[run_one(target) for target in rest])
+    return all(target.ok for target in targets)
+
+def print_report(targets: typing.List[Target], elapsed: float) -> None:
+    steps = ["check", "push", "reboot", "verify", "total"]
+    print()
+    print(f"{'device':<20} " + " ".join(f"{name:>7}" for name in steps) + "  result")
+    for target in targets:
+        times = " ".join((f"{target.timings[name]:7.1f}" if name in target.timings else f"{'-':>7}")
+                         for name in steps)
+        print(f"{target.name:<20} {times}  {target.result}")
+    device_time = sum(target.timings.get("total", 0.0) for target in targets)
+    print(f"Rollout took {elapsed:1.1f}s; the devices took {device_time:1.1f}s in total")
+
+def read_inventory(path: str) -> typing.List[typing.Tuple[str, str]]:
+    devices = []
+    with open(path, "rt", encoding="utf-8") as fd:
+        for line in fd:
+            fields = line.split()
+            if (len(fields) == 0) or fields[0].startswith("#"):
+                continue
+            if len(fields) != 2:
+                raise RolloutError(f"{path}: expected 'name board_id': {line.strip()}")
+            devices.append((fields[0], fields[1]))
+    return devices
+
+class FaultyStandInDevice(rpc_pool.StandInDevice):
+    """An emulated device that reboots into its old firmware after an update."""
+
+    def ota_stream(self, data: bytes, parameter: int) -> rpc_pool.Result:
+        if parameter == ota_pack.OTA_ACTIVATE:
+            firmware = self.firmware
+            result = super().ota_stream(data, parameter)
+            self.firmware = firmware
+            return result
+        return super().ota_stream(data, parameter)
+
+def make_emulated_device(i: int, faulty: bool, silent: bool, base: bytes) -> rpc_pool.StandInDevice:
+    cls = FaultyStandInDevice if faulty else rpc_pool.StandInDevice
+    device = cls(f"emulated-{i}", round_trip=random.uniform(0.01, 0.05),
+                 reboot_time=random.uniform(3.0, 6.0), firmware=base, settings=b"old settings\n",
+                 silent_activate=silent)
+    if (i % 3) == 1:
+        device.manual_mode = "MANUAL_OFF"
+    elif (i % 3) == 2:
+        # set by the schedule, which gives AUTO_DARK no end time
+        device.manual_mode = "AUTO_DARK"
+        device.manual_mode_end_s = 0
+    return device
+
+async def run(args: argparse.Namespace) -> bool:
+    update = Update(args.command, args.file, args.base)
+    base = b""
+    if args.base is not None:
+        with open(args.base, "rb") as fd:
+            base = fd.read()
+    elif (len(update.image) > 0) and (args.emulate is not None):
+        # emulated devices must have the base firmware for a delta image
+        (magic, version, flags) = struct.unpack_from("<IHH", update.image, 0)
+        if flags & ota_pack.OTA_FLAG_DELTA:
+            raise RolloutError("--base is needed to emulate a delta update")
+
+    async with rpc_pool.Pool(lanes=1, max_backoff=MAX_BACKOFF) as pool:
+        targets = []
+        if args.emulate is not None:
+            if (args.command == "firmware") and (len(update.image) == 0):
+                raise RolloutError("emulated devices only accept OTA images or main.bin")
+            for i in range(args.emulate):
+                stand_in = make_emulated_device(i, i >= (args.emulate - args.emulate_faulty),
+                                                args.emulate_silent, base)
+                device = pool.add(stand_in.name, rpc_pool.StandInConnector(stand_in))
+                targets.append(Target(stand_in.name, None, device, stand_in))
+        else:
+            for (name, board_id) in read_inventory(args.inventory):
+                device = pool.add(name, rpc_pool.RemotePicotoolConnector(board_id))
+                targets.append(Target(name, board_id, device))
+
+        start_time = time.monotonic()
+        ok = await rollout(targets, update, args.concurrency, args.canary,
+                           args.chunk, args.reboot_timeout, args.force)
+        print_report(targets, time.monotonic() - start_time)
+        return ok
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Update firmware or settings on many devices")
+    sub = parser.add_subparsers(dest="command", required=True)
+    for (command, help_text) in [("firmware", "main.bin, .vota or .uf2 file"),
+                                 ("settings", "wifi-settings file")]:
+        p = sub.add_parser(command, help=f"send a {help_text}")
+        p.add_argument("inventory", nargs="?", default=None, help="device inventory file")
+        p.add_argument("file", help=help_text)
+        p.add_argument("--base", default=None, help="deployed main.bin, for a delta image")
+        p.add_argument("--concurrency", type=int, default=DEFAULT_CONCURRENCY,
+                help="maximum number of devices updated at once")
+        p.add_argument("--canary", type=int, default=DEFAULT_CANARY,
+                help="number of devices updated first")
+        p.add_argument("--chunk", type=int, default=2048, help="bytes per OTA request")
+        p.add_argument("--reboot-timeout", type=float, default=DEFAULT_REBOOT_TIMEOUT,
+                help="seconds to wait for each device to restart")
+        p.add_argument("--force", action="store_true", help="update devices that are already up to date")
+        p.add_argument("--emulate", type=int, default=None, metavar="N",
+                help="use N emulated devices instead of the inventory")
+        p.add_argument("--emulate-faulty", type=int, default=0, metavar="N",
+                help="number of emulated devices that fail to update")
+        p.add_argument("--emulate-silent", action="store_true",
+                help="emulated devices do not reply to OTA activation (as older firmware)")
+    args = parser.parse_args()
+    if (args.inventory is None) and (args.emulate is None):
+        parser.error("an inventory file is needed (or --emulate)")
+    if args.concurrency < 1:
+        parser.error("--concurrency must be at least 1")
+
+    try:
+        ok = asyncio.run(run(args))
+    except RolloutError as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+    sys.exit(0 if ok else 1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system configuration values
+ *
+ * These functions read numeric values from the wifi-settings file,
+ * returning a default if the key is absent or the value is not valid.
+ * 
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "pico/stdlib.h"
+
+#include "wifi_settings.h"
+
+float config_get_float(const char* key, float default_value) {
+    char tmp[16];
+    uint size = sizeof(tmp) - 1;
+    if (!wifi_settings_get_value_for_key(key, tmp, &size)) {
+        return default_value;
+    }
+    tmp[size] = '\0';
+    char* end = NULL;
+    float value = strtof(tmp, &end);
+    if ((end[0] == '\0') && (end != tmp)) {
+        // read at least one digit and reached the end of the string
+        return value;
+    }
+    return default_value;
+}
+
+int config_get_int(const char* key, int min_value, int default_value, int max_value) {
+    char tmp[16];
+    uint size = sizeof(tmp) - 1;
+    if (!wifi_settings_get_value_for_key(key, tmp, &size)) {
+        return default_value;
+    }
+    tmp[size] = '\0';
+    char* end = NULL;
+    long value = strtol(tmp, &end, 0);
+    if ((end[0] == '\0') && (end != tmp)) {
+        // read at least one digit and reached the end of the string
+        if ((value >= (long) min_value) && (value <= (long) max_value)) {
+            // value is within the allowed range
+            return value;
+        }
+    }
+    return default_value;
+}
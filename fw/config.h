@@ -0,0 +1,20 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system configuration values
+ *
+ * These functions read numeric values from the wifi-settings file,
+ * returning a default if the key is absent or the value is not valid.
+ * 
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+float config_get_float(const char* key, float default_value);
+// The value must be in the range min_value .. max_value (inclusive)
+int config_get_int(const char* key, int min_value, int default_value, int max_value);
+
+#endif
@@ -48,6 +48,15 @@
 #define DHCP_DOES_ARP_CHECK         0
 #define LWIP_DHCP_DOES_ACD_CHECK    0
 
+// SNTP provides the time of day for the schedule (see schedule.c)
+#include <stdint.h>
+void schedule_set_unix_time(uint32_t unix_time_s);
+#define SNTP_SERVER_DNS             1
+#define SNTP_STARTUP_DELAY          0
+#define SNTP_UPDATE_DELAY           (60 * 60 * 1000)
+#define SNTP_SET_SYSTEM_TIME(sec)   schedule_set_unix_time(sec)
+#define MEMP_NUM_SYS_TIMEOUT        (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 1)
+
 #ifndef NDEBUG
 #define LWIP_DEBUG                  1
 #define LWIP_STATS                  1
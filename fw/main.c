@@ -10,14 +10,17 @@
  * https://github.com/jwhitham/pico-wifi-settings
  * 
  */
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "pico/stdlib.h"
 #include "pico/bootrom.h"
 #include "pico/cyw43_driver.h"
 #include "pico/multicore.h"
+#include "pico/rand.h"
 
 #include "wifi_settings.h"
 
@@ -29,15 +32,28 @@
 
 #include "leds.h"
 #include "temperature.h"
+#include "schedule.h"
+#include "report.h"
+#include "ota_stream.h"
 #include "settings.h"
+#include "config.h"
 
 #if PICO_CYW43_ARCH_POLL
 #error "Expected interrupt settings"
 #endif
 
-#define MAX_REPORT_SIZE     100
+#define MAX_REPORT_SIZE     256         // worst case is 184 bytes (line protocol, 31 character name)
+#define MAX_SUBSCRIBERS     8
+#define MAX_SUBSCRIPTION_LEASE_S (60 * 60 * 24)
 #define ID_GET_STATUS_HANDLER (ID_FIRST_USER_HANDLER + 0)
 #define ID_SET_RELAYS_HANDLER (ID_FIRST_USER_HANDLER + 1)
+#define ID_OTA_STREAM_HANDLER (ID_FIRST_USER_HANDLER + 2)
+
+#define SPECTRUM_PENDING    1           // remote_handler_get_status parameter 4: call again
+
+#define SNAPSHOT_MAGIC      0x504e5356  // "VSNP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_DEADBAND_DC 5          // temperature change that advances the sequence number
 
 
 typedef enum {
@@ -69,12 +85,116 @@ typedef struct config_t {
     ip_addr_t                   report_addr;
     int                         report_port;
     int                         report_interval_s;
+    float                       report_deadband;
+    int                         report_heartbeat_s;
     int                         manual_timeout_s;
     int                         control_port;
+    int                         subscription_lease_s;
+    report_format_t             report_format;
+    char                        report_name[32];
+    bool                        adaptive_sampling;
 } config_t;
 
+typedef struct subscriber_t {
+    ip_addr_t                   addr;
+    uint16_t                    port;               // 0 if this entry is unused
+    absolute_time_t             lease_end_time;
+} subscriber_t;
+
+typedef struct counters_t {
+    uint32_t                    reports_sent;
+    uint32_t                    commands_accepted;
+    uint32_t                    commands_rejected;
+    uint32_t                    control_changes;
+    uint32_t                    report_datagrams_sent;
+    uint32_t                    subscribers;        // number of active subscribers
+    uint32_t                    subscriptions_expired;
+    uint32_t                    reports_suppressed;
+    uint32_t                    samples_lost;       // captured samples overwritten before they were copied
+} counters_t;
+
+// Consolidated status snapshot (remote_handler_get_status parameter 3).
+// The response is a snapshot_header_t followed by a sequence of sections,
+// each introduced by a snapshot_section_header_t giving its type and size.
+// Clients should skip sections they do not recognise, and should accept
+// sections that are larger than expected (new fields are added at the end).
+// All values are little-endian.
+typedef enum {
+    SNAPSHOT_SECTION_STATUS = 1,    // snapshot_status_t
+    SNAPSHOT_SECTION_CONFIG,        // snapshot_config_t
+    SNAPSHOT_SECTION_COUNTERS,      // counters_t
+    SNAPSHOT_SECTION_SAMPLES,       // int16_t ADC samples, oldest first
+    SNAPSHOT_SECTION_SCHEDULE,      // snapshot_schedule_t
+    SNAPSHOT_SECTION_VERSION,       // snapshot_version_t
+} snapshot_section_type_t;
+
+// Request flags: ADC samples are only sent (and removed from the capture buffer)
+// if the client asks for them, so that polling for status does not take them
+// away from temperature_copy.py
+#define SNAPSHOT_REQUEST_SAMPLES    (1 << 0)
+
+typedef struct __attribute__((packed)) snapshot_request_t {
+    uint32_t                    boot_id;            // from a previous snapshot_header_t
+    uint32_t                    since_sequence;     // from a previous snapshot_header_t
+    uint32_t                    flags;              // SNAPSHOT_REQUEST_*, optional (0 if absent)
+} snapshot_request_t;
+
+typedef struct __attribute__((packed)) snapshot_header_t {
+    uint32_t                    magic;
+    uint16_t                    version;
+    uint16_t                    header_size;
+    uint32_t                    boot_id;            // random value chosen at boot
+    uint32_t                    sequence;           // incremented when status or counters change
+    uint32_t                    uptime_s;
+} snapshot_header_t;
+
+typedef struct __attribute__((packed)) snapshot_section_header_t {
+    uint16_t                    type;
+    uint16_t                    size;               // size of the section data following the header
+} snapshot_section_header_t;
+
+typedef struct __attribute__((packed)) snapshot_status_t {
+    int16_t                     external_temperature_dc;    // tenths of a degree Celsius
+    int16_t                     internal_temperature_dc;    // tenths of a degree Celsius
+    uint8_t                     temperature_band;
+    uint8_t                     manual_mode;
+    uint8_t                     next_control_mode;
+    uint8_t                     current_control_mode;
+    uint32_t                    manual_mode_end_s;          // uptime when manual mode ends
+    uint16_t                    sample_rate_hz;
+} snapshot_status_t;
+
+typedef struct __attribute__((packed)) snapshot_config_t {
+    int16_t                     cold_threshold_dc;          // tenths of a degree Celsius
+    int16_t                     not_cold_threshold_dc;
+    int16_t                     not_hot_threshold_dc;
+    int16_t                     hot_threshold_dc;
+    uint32_t                    change_delay_s;
+    uint32_t                    report_interval_s;
+    uint32_t                    manual_timeout_s;
+    uint32_t                    report_addr;                // IPv4 address, network byte order
+    uint16_t                    report_port;
+    uint16_t                    control_port;
+    int16_t                     report_deadband_dc;         // tenths of a degree Celsius
+    uint32_t                    report_heartbeat_s;
+} snapshot_config_t;
+
+typedef struct __attribute__((packed)) snapshot_schedule_t {
+    uint32_t                    unix_time;                  // 0 if the time is not known
+    uint32_t                    next_transition;            // unix time of the next rule, 0 if none
+    int8_t                      active_rule;                // -1 if none
+    uint8_t                     num_rules;
+} snapshot_schedule_t;
+
+typedef struct __attribute__((packed)) snapshot_version_t {
+    uint32_t                    firmware_size;
+    uint32_t                    firmware_crc;               // CRC-32 of main.bin
+    uint32_t                    settings_crc;               // CRC-32 of the wifi-settings file
+} snapshot_version_t;
+
 typedef struct control_status_t {
     config_t                    config;
+    counters_t                  counters;
     int                         heartbeat_counter;
     temperature_t               temperature_band;
     manual_mode_t               manual_mode;
@@ -82,10 +202,23 @@ typedef struct control_status_t {
     control_mode_t              current_control_mode;
     absolute_time_t             control_mode_update_time;
     absolute_time_t             report_update_time;
+    absolute_time_t             report_heartbeat_time;
     absolute_time_t             manual_mode_end_time;
     float                       external_temperature_value;
+    float                       reported_external_temperature_value;
+    temperature_t               reported_temperature_band;
+    manual_mode_t               reported_manual_mode;
     struct temperature_t*       temperature_handle;
+    struct schedule_t*          schedule_handle;
+    struct ota_stream_t*        ota_handle;
     struct udp_pcb*             comms_pcb;
+    subscriber_t                subscribers[MAX_SUBSCRIBERS];
+    uint32_t                    boot_id;
+    uint32_t                    snapshot_sequence;
+    snapshot_status_t           snapshot_status;
+    counters_t                  snapshot_counters;
+    bool                        spectrum_request;   // set by the remote handler, cleared by the main loop
+    uint32_t                    spectrum_request_hz;
 } control_status_t;
 
 static bool is_manual_mode(manual_mode_t mode) {
@@ -98,7 +231,20 @@ static bool is_manual_mode(manual_mode_t mode) {
     }
 }
 
-static void make_report(control_status_t* cs, char* message, size_t size) {
+static int16_t to_decicelsius(float value) {
+    // Round as printf("%1.1f") would: the product is exact in double precision,
+    // and rint() rounds exact halves to even, e.g. -299.25 becomes -299.2.
+    // The only difference is that printf's "-0.0" (for -0.05 < value < 0) is reported as 0.0.
+    const double scaled = rint((double) value * 10.0);
+    if (scaled >= (double) INT16_MAX) {
+        return INT16_MAX;
+    } else if (scaled <= (double) INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t) scaled;
+}
+
+static size_t make_report(control_status_t* cs, report_format_t format, char* message, size_t size) {
     const char* control_text = "OFF";
     switch (cs->current_control_mode) {
         case CONTROL_ON:
@@ -126,40 +272,256 @@ static void make_report(control_status_t* cs, char* message, size_t size) {
     const uint64_t uptime = to_us_since_boot(get_absolute_time()) / 1000000ULL;
     const float internal_temperature_value = temperature_internal(cs->temperature_handle);
 
-    snprintf(message, size,
-        "ext %1.1f int %1.1f control %s auto %u temp %s up %u\n",
-        (double) cs->external_temperature_value,
-        (double) internal_temperature_value,
-        control_text,
-        is_manual_mode(cs->manual_mode) ? 0 : 1,
-        temp_text,
-        (unsigned) uptime);
+    report_writer_t w;
+    report_begin(&w, format, cs->config.report_name, message, size);
+    report_add_decicelsius(&w, "ext", to_decicelsius(cs->external_temperature_value));
+    report_add_decicelsius(&w, "int", to_decicelsius(internal_temperature_value));
+    report_add_text(&w, "control", control_text);
+    report_add_uint(&w, "auto", is_manual_mode(cs->manual_mode) ? 0 : 1);
+    report_add_text(&w, "temp", temp_text);
+    report_add_uint(&w, "up", (uint32_t) uptime);
+    if (cs->config.adaptive_sampling) {
+        report_add_uint(&w, "rate", temperature_sample_rate(cs->temperature_handle));
+    }
+    return report_end(&w, schedule_unix_time(cs->schedule_handle));
+}
+
+static bool send_by_udp(control_status_t* cs, const char* message, size_t size,
+                        const ip_addr_t* addr, uint16_t port) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM);
+    if (!p) {
+        return false;
+    }
+
+    memcpy(p->payload, message, size);
+    const bool ok = (udp_sendto(cs->comms_pcb, p, addr, port) == ERR_OK);
+    pbuf_free(p);
+    if (ok) {
+        cs->counters.report_datagrams_sent++;
+    }
+    return ok;
+}
+
+static bool has_report_destination(control_status_t* cs) {
+    return (cs->config.report_port || cs->counters.subscribers) && cs->comms_pcb;
 }
 
 static void make_report_and_send_by_udp(control_status_t* cs) {
-    if ((!cs->config.report_port) || (!cs->comms_pcb)) {
+    if (!has_report_destination(cs)) {
         // reporting is disabled
         return;
     }
     char message[MAX_REPORT_SIZE];
-    make_report(cs, message, sizeof(message));
-    size_t size = strlen(message);
-
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM);
-    if (!p) {
+    const size_t size = make_report(cs, cs->config.report_format, message, sizeof(message));
+    if (size == 0) {
+        // did not fit: a truncated report would not be valid
         return;
     }
 
-    memcpy(p->payload, message, size);
-    (void) udp_sendto(cs->comms_pcb, p, &cs->config.report_addr, cs->config.report_port);
-    pbuf_free(p);
+    // The report is generated once and then sent to each destination:
+    // the configured report address (which may be a multicast group)
+    // and every subscriber
+    bool sent = false;
+    if (cs->config.report_port) {
+        sent |= send_by_udp(cs, message, size, &cs->config.report_addr, cs->config.report_port);
+    }
+    for (uint i = 0; i < MAX_SUBSCRIBERS; i++) {
+        const subscriber_t* sub = &cs->subscribers[i];
+        if (sub->port) {
+            sent |= send_by_udp(cs, message, size, &sub->addr, sub->port);
+        }
+    }
+    if (sent) {
+        cs->counters.reports_sent++;
+    }
+
+    // Record what was reported, so that the next report is only sent if something changed
+    cs->reported_external_temperature_value = cs->external_temperature_value;
+    cs->reported_temperature_band = cs->temperature_band;
+    cs->reported_manual_mode = cs->manual_mode;
+    cs->report_heartbeat_time = make_timeout_time_ms(cs->config.report_heartbeat_s * 1000);
 }
 
+static void expire_subscribers(control_status_t* cs) {
+    for (uint i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t* sub = &cs->subscribers[i];
+        if (sub->port && time_reached(sub->lease_end_time)) {
+            sub->port = 0;
+            cs->counters.subscribers--;
+            cs->counters.subscriptions_expired++;
+        }
+    }
+}
+
+static void make_snapshot_status(control_status_t* cs, snapshot_status_t* status) {
+    memset(status, 0, sizeof(snapshot_status_t));
+    status->external_temperature_dc = to_decicelsius(cs->external_temperature_value);
+    status->internal_temperature_dc = to_decicelsius(temperature_internal(cs->temperature_handle));
+    status->temperature_band = (uint8_t) cs->temperature_band;
+    status->manual_mode = (uint8_t) cs->manual_mode;
+    status->next_control_mode = (uint8_t) cs->next_control_mode;
+    status->current_control_mode = (uint8_t) cs->current_control_mode;
+    status->manual_mode_end_s = (uint32_t) (to_us_since_boot(cs->manual_mode_end_time) / 1000000ULL);
+    status->sample_rate_hz = (uint16_t) temperature_sample_rate(cs->temperature_handle);
+}
+
+static void make_snapshot_config(control_status_t* cs, snapshot_config_t* config) {
+    memset(config, 0, sizeof(snapshot_config_t));
+    config->cold_threshold_dc = to_decicelsius(cs->config.cold_threshold);
+    config->not_cold_threshold_dc = to_decicelsius(cs->config.not_cold_threshold);
+    config->not_hot_threshold_dc = to_decicelsius(cs->config.not_hot_threshold);
+    config->hot_threshold_dc = to_decicelsius(cs->config.hot_threshold);
+    config->change_delay_s = (uint32_t) cs->config.change_delay_s;
+    config->report_interval_s = (uint32_t) cs->config.report_interval_s;
+    config->manual_timeout_s = (uint32_t) cs->config.manual_timeout_s;
+    config->report_addr = ip4_addr_get_u32(ip_2_ip4(&cs->config.report_addr));
+    config->report_port = (uint16_t) cs->config.report_port;
+    config->control_port = (uint16_t) cs->config.control_port;
+    config->report_deadband_dc = to_decicelsius(cs->config.report_deadband);
+    config->report_heartbeat_s = (uint32_t) cs->config.report_heartbeat_s;
+}
+
+static bool snapshot_temperature_changed(int16_t value_dc, int16_t previous_dc) {
+    return abs(value_dc - previous_dc) >= SNAPSHOT_DEADBAND_DC;
+}
+
+static void snapshot_update(control_status_t* cs) {
+    // Called on every tick: the sequence number only advances if something
+    // visible in the snapshot has really changed, so an idle system keeps the same number.
+    // Temperatures are noisy, so they must move by SNAPSHOT_DEADBAND_DC.
+    // reports_suppressed and samples_lost advance while the system is idle, so they
+    // are ignored (the current values are sent when something else changes).
+    snapshot_status_t status;
+    make_snapshot_status(cs, &status);
+    snapshot_status_t compare = status;
+    compare.external_temperature_dc = cs->snapshot_status.external_temperature_dc;
+    compare.internal_temperature_dc = cs->snapshot_status.internal_temperature_dc;
+    counters_t counters = cs->counters;
+    counters.reports_suppressed = cs->snapshot_counters.reports_suppressed;
+    counters.samples_lost = cs->snapshot_counters.samples_lost;
+
+    if ((memcmp(&compare, &cs->snapshot_status, sizeof(snapshot_status_t)) != 0)
+    || (memcmp(&counters, &cs->snapshot_counters, sizeof(counters_t)) != 0)
+    || snapshot_temperature_changed(status.external_temperature_dc, cs->snapshot_status.external_temperature_dc)
+    || snapshot_temperature_changed(status.internal_temperature_dc, cs->snapshot_status.internal_temperature_dc)) {
+        cs->snapshot_status = status;
+        cs->snapshot_counters = cs->counters;
+        cs->snapshot_sequence++;
+    }
+}
+
+static uint32_t snapshot_add_section(uint8_t* data_buffer, uint32_t size, uint32_t max_size,
+                                     snapshot_section_type_t type, const void* data, uint32_t data_size) {
+    snapshot_section_header_t section;
+    if ((size + sizeof(section) + data_size) > max_size) {
+        // does not fit - section is omitted
+        return size;
+    }
+    section.type = (uint16_t) type;
+    section.size = (uint16_t) data_size;
+    memcpy(&data_buffer[size], &section, sizeof(section));
+    size += sizeof(section);
+    memcpy(&data_buffer[size], data, data_size);
+    return size + data_size;
+}
+
+static uint32_t make_snapshot(control_status_t* cs, uint8_t* data_buffer,
+                              uint32_t input_data_size, uint32_t max_size) {
+    // The request (if any) shares the buffer with the response, so read it first
+    // (older clients send only the boot_id and sequence number, without flags)
+    snapshot_request_t request;
+    memset(&request, 0, sizeof(request));
+    if (input_data_size >= offsetof(snapshot_request_t, flags)) {
+        memcpy(&request, data_buffer, (input_data_size < sizeof(request)) ? input_data_size : sizeof(request));
+    }
+
+    // A full snapshot is sent for a new client or if the device restarted since
+    // the client's last request; otherwise, only the things that changed are sent.
+    const bool full = (request.boot_id != cs->boot_id)
+                || (request.since_sequence == 0)
+                || (request.since_sequence > cs->snapshot_sequence);
+    const bool changed = full || (request.since_sequence != cs->snapshot_sequence);
+
+    snapshot_header_t header;
+    uint32_t size = sizeof(header);
+    if (size > max_size) {
+        return 0;
+    }
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    header.boot_id = cs->boot_id;
+    header.sequence = cs->snapshot_sequence;
+    header.uptime_s = (uint32_t) (to_us_since_boot(get_absolute_time()) / 1000000ULL);
+    memcpy(data_buffer, &header, sizeof(header));
+
+    if (changed) {
+        size = snapshot_add_section(data_buffer, size, max_size, SNAPSHOT_SECTION_STATUS,
+                                    &cs->snapshot_status, sizeof(snapshot_status_t));
+        size = snapshot_add_section(data_buffer, size, max_size, SNAPSHOT_SECTION_COUNTERS,
+                                    &cs->snapshot_counters, sizeof(counters_t));
+
+        snapshot_schedule_t schedule;
+        schedule.unix_time = schedule_unix_time(cs->schedule_handle);
+        schedule.next_transition = schedule_next_transition(cs->schedule_handle);
+        schedule.active_rule = (int8_t) schedule_active_rule(cs->schedule_handle);
+        schedule.num_rules = (uint8_t) schedule_num_rules(cs->schedule_handle);
+        size = snapshot_add_section(data_buffer, size, max_size, SNAPSHOT_SECTION_SCHEDULE,
+                                    &schedule, sizeof(schedule));
+    }
+    if (full) {
+        snapshot_config_t config;
+        make_snapshot_config(cs, &config);
+        size = snapshot_add_section(data_buffer, size, max_size, SNAPSHOT_SECTION_CONFIG,
+                                    &config, sizeof(config));
+
+        snapshot_version_t version;
+        version.firmware_size = ota_stream_firmware_size(cs->ota_handle);
+        version.firmware_crc = ota_stream_firmware_crc(cs->ota_handle);
+        version.settings_crc = ota_stream_settings_crc(cs->ota_handle);
+        size = snapshot_add_section(data_buffer, size, max_size, SNAPSHOT_SECTION_VERSION,
+                                    &version, sizeof(version));
+    }
+
+    // New samples, if requested, fill whatever space remains
+    snapshot_section_header_t section;
+    if ((request.flags & SNAPSHOT_REQUEST_SAMPLES) && ((size + sizeof(section)) < max_size)) {
+        uint32_t samples_size = max_size - size - sizeof(section);
+        if (samples_size > UINT16_MAX) {
+            samples_size = UINT16_MAX;
+        }
+        samples_size = temperature_copy(cs->temperature_handle,
+                                        &data_buffer[size + sizeof(section)], samples_size & ~1);
+        if (samples_size > 0) {
+            section.type = SNAPSHOT_SECTION_SAMPLES;
+            section.size = (uint16_t) samples_size;
+            memcpy(&data_buffer[size], &section, sizeof(section));
+            size += sizeof(section) + samples_size;
+        }
+    }
+    return size;
+}
+
+
+static bool manual_setting(control_status_t* cs, const char* command, size_t size);
+
+static float threshold_distance(control_status_t* cs) {
+    const float t = cs->external_temperature_value;
+    switch (cs->temperature_band) {
+        case TEMP_COLD:
+            return cs->config.not_cold_threshold - t;
+        case TEMP_HOT:
+            return t - cs->config.not_hot_threshold;
+        default:
+            return fminf(t - cs->config.cold_threshold, cs->config.hot_threshold - t);
+    }
+}
 
 static void periodic_task(control_status_t* cs) {
     // Read temperature sensors
     temperature_update(cs->temperature_handle);
     cs->external_temperature_value = temperature_external(cs->temperature_handle);
+    cs->counters.samples_lost = temperature_samples_lost(cs->temperature_handle);
 
     // Determine temperature range
     switch (cs->temperature_band) {
@@ -186,6 +548,22 @@ static void periodic_task(control_status_t* cs) {
             break;
     }
 
+    // Sample more quickly when close to a threshold that would change the band
+    if (cs->config.adaptive_sampling) {
+        temperature_adapt(cs->temperature_handle, threshold_distance(cs));
+    }
+
+    // Scheduled mode change: the schedule computes the time of its next transition,
+    // so there is nothing to do on most ticks. A scheduled mode lasts until the next
+    // transition, unless overridden by a command.
+    if (schedule_due(cs->schedule_handle)) {
+        absolute_time_t until = nil_time;
+        const char* command = schedule_update(cs->schedule_handle, &until);
+        if (command && manual_setting(cs, command, strlen(command))) {
+            cs->manual_mode_end_time = until;
+        }
+    }
+
     // Leave manual mode if the timeout is reached
     if (is_manual_mode(cs->manual_mode)
     && time_reached(cs->manual_mode_end_time)) {
@@ -242,6 +620,7 @@ static void periodic_task(control_status_t* cs) {
                 break;
         }
         cs->control_mode_update_time = make_timeout_time_ms(cs->config.change_delay_s * 1000);
+        cs->counters.control_changes++;
         output_changed = true;
     }
 
@@ -302,11 +681,28 @@ static void periodic_task(control_status_t* cs) {
         cs->heartbeat_counter++;
     }
 
-    // UDP report: send periodic update
-    if (time_reached(cs->report_update_time) || output_changed) {
-        cs->report_update_time = delayed_by_ms(cs->report_update_time, cs->config.report_interval_s * 1000);
+    // Subscriptions end when the lease expires
+    expire_subscribers(cs);
+
+    // UDP report: send immediately if the outputs, the temperature band or the mode changed.
+    // Otherwise, check at each report interval: send only if the temperature moved
+    // outside the deadband around the last reported value, or if the heartbeat is due.
+    if (output_changed
+    || (cs->temperature_band != cs->reported_temperature_band)
+    || (cs->manual_mode != cs->reported_manual_mode)) {
         make_report_and_send_by_udp(cs);
+    } else if (time_reached(cs->report_update_time)) {
+        cs->report_update_time = delayed_by_ms(cs->report_update_time, cs->config.report_interval_s * 1000);
+        if ((fabsf(cs->external_temperature_value - cs->reported_external_temperature_value) >= cs->config.report_deadband)
+        || time_reached(cs->report_heartbeat_time)) {
+            make_report_and_send_by_udp(cs);
+        } else if (has_report_destination(cs)) {
+            cs->counters.reports_suppressed++;
+        }
     }
+
+    // Snapshot sequence number advances if anything changed
+    snapshot_update(cs);
 }
 
 static int32_t remote_handler_get_status(
@@ -318,12 +714,32 @@ static int32_t remote_handler_get_status(
         void* arg) {
 
     control_status_t* cs = (control_status_t *) arg;
+    if (input_parameter == 4) {
+        // Noise spectrum: a burst of samples is captured at a high rate (optionally
+        // specified by a 32-bit value in the input data) and analysed. The capture
+        // takes up to 0.5 seconds, so it is done by the main loop: the first request
+        // returns SPECTRUM_PENDING, and the client repeats it until the result is ready.
+        uint32_t sample_rate_hz = 0;
+        if (input_data_size >= sizeof(sample_rate_hz)) {
+            memcpy(&sample_rate_hz, data_buffer, sizeof(sample_rate_hz));
+        }
+        *output_data_size = temperature_spectrum(cs->temperature_handle, sample_rate_hz,
+                                                 data_buffer, *output_data_size);
+        if (*output_data_size > 0) {
+            return 0;
+        }
+        if (!cs->spectrum_request) {
+            cs->spectrum_request_hz = sample_rate_hz;
+            cs->spectrum_request = true;
+        }
+        return SPECTRUM_PENDING;
+    }
+
     uint32_t flags = save_and_disable_interrupts();
     switch (input_parameter) {
         case 0:
             // Text report
-            make_report(cs, (char*) data_buffer, (size_t) *output_data_size);
-            *output_data_size = strlen((char*) data_buffer);
+            *output_data_size = make_report(cs, REPORT_FORMAT_TEXT, (char*) data_buffer, (size_t) *output_data_size);
             break;
         case 1:
             // Data structure dump
@@ -336,6 +752,11 @@ static int32_t remote_handler_get_status(
             // Temperature report dump
             *output_data_size = temperature_copy(cs->temperature_handle, data_buffer, *output_data_size);
             break;
+        case 3:
+            // Consolidated snapshot: status, counters, config and new samples,
+            // or only the changes since a previous snapshot (see snapshot_request_t)
+            *output_data_size = make_snapshot(cs, data_buffer, input_data_size, *output_data_size);
+            break;
         default:
             *output_data_size = 0;
             break;
@@ -365,7 +786,10 @@ static bool manual_setting(control_status_t* cs, const char* command, size_t siz
     }
     if (ok) {
         cs->manual_mode_end_time = make_timeout_time_ms(cs->config.manual_timeout_s * 1000);
+        cs->counters.commands_accepted++;
         make_report_and_send_by_udp(cs);
+    } else {
+        cs->counters.commands_rejected++;
     }
     restore_interrupts(flags);
     return ok;
@@ -386,46 +810,128 @@ static int32_t remote_handler_set_relays(
     return 0;
 }
 
-static void comms_recv_callback(void *arg, struct udp_pcb *pcb,
-        struct pbuf *p, const ip_addr_t *addr, u16_t port) {
-    control_status_t* cs = (control_status_t *) arg;
-    (void) manual_setting(cs, (const char*) p->payload, (size_t) p->len);
-    pbuf_free(p);
-}
-
-static int config_get_float(const char* key, float default_value) {
+static bool subscription_setting(control_status_t* cs, const char* command, size_t size,
+                                 const ip_addr_t* addr, uint16_t port) {
+    // Commands are "sub" (use the default lease), "sub <seconds>" or "unsub"
     char tmp[16];
-    uint size = sizeof(tmp) - 1;
-    if (!wifi_settings_get_value_for_key(key, tmp, &size)) {
-        return default_value;
+    if (size >= sizeof(tmp)) {
+        return false;
     }
+    memcpy(tmp, command, size);
     tmp[size] = '\0';
-    char* end = NULL;
-    float value = strtof(tmp, &end);
-    if ((end[0] == '\0') && (end != tmp)) {
-        // read at least one digit and reached the end of the string
-        return value;
+
+    int lease_s = cs->config.subscription_lease_s;
+    if (strcmp(tmp, "unsub") == 0) {
+        lease_s = 0;
+    } else if (strncmp(tmp, "sub ", 4) == 0) {
+        char* end = NULL;
+        long value = strtol(&tmp[4], &end, 10);
+        if ((end[0] != '\0') || (end == &tmp[4]) || (value < 1)) {
+            return false;
+        }
+        lease_s = (value > MAX_SUBSCRIPTION_LEASE_S) ? MAX_SUBSCRIPTION_LEASE_S : (int) value;
+    } else if (strcmp(tmp, "sub") != 0) {
+        return false;
     }
-    return default_value;
-}
 
-static int config_get_int(const char* key, int min_value, int default_value, int max_value) {
-    char tmp[16];
-    uint size = sizeof(tmp) - 1;
-    if (!wifi_settings_get_value_for_key(key, tmp, &size)) {
-        return default_value;
+    uint32_t flags = save_and_disable_interrupts();
+    // Find the existing subscription for this address and port, or a free entry
+    subscriber_t* sub = NULL;
+    for (uint i = 0; i < MAX_SUBSCRIBERS; i++) {
+        if (cs->subscribers[i].port == port && ip_addr_cmp(&cs->subscribers[i].addr, addr)) {
+            sub = &cs->subscribers[i];
+            break;
+        }
+        if ((!cs->subscribers[i].port) && (!sub)) {
+            sub = &cs->subscribers[i];
+        }
     }
-    tmp[size] = '\0';
-    char* end = NULL;
-    long value = strtol(tmp, &end, 0);
-    if ((end[0] == '\0') && (end != tmp)) {
-        // read at least one digit and reached the end of the string
-        if ((value >= (long) min_value) && (value <= (long) max_value)) {
-            // value is within the allowed range
-            return value;
+
+    bool ok = true;
+    if (lease_s == 0) {
+        // Unsubscribe
+        if (sub && sub->port) {
+            sub->port = 0;
+            cs->counters.subscribers--;
+        }
+    } else if (sub) {
+        // Subscribe or renew the lease
+        if (!sub->port) {
+            ip_addr_copy(sub->addr, *addr);
+            sub->port = port;
+            cs->counters.subscribers++;
         }
+        sub->lease_end_time = make_timeout_time_ms(lease_s * 1000);
+        // The subscriber receives the current state immediately
+        char message[MAX_REPORT_SIZE];
+        const size_t size = make_report(cs, cs->config.report_format, message, sizeof(message));
+        if (size != 0) {
+            (void) send_by_udp(cs, message, size, addr, port);
+        }
+    } else {
+        // No free entries
+        ok = false;
+    }
+
+    if (ok) {
+        cs->counters.commands_accepted++;
+    } else {
+        cs->counters.commands_rejected++;
+    }
+    restore_interrupts(flags);
+    return true;
+}
+
+static int32_t remote_handler_ota_stream(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    // Compressed or delta firmware update (see ota_stream.c and ota_pack.py)
+    control_status_t* cs = (control_status_t *) arg;
+    ota_result_t result = OTA_ERROR_STATE;
+    uint32_t staging_address = 0;
+    const uint32_t max_size = *output_data_size;
+    *output_data_size = 0;
+    if (!cs->ota_handle) {
+        return OTA_ERROR_STATE;
     }
-    return default_value;
+    switch (input_parameter) {
+        case 0:
+            // Begin: input is the ota_header_t, output is the staging address
+            result = ota_stream_begin(cs->ota_handle, data_buffer, input_data_size, &staging_address);
+            if ((result == OTA_OK) && (max_size >= sizeof(staging_address))) {
+                memcpy(data_buffer, &staging_address, sizeof(staging_address));
+                *output_data_size = sizeof(staging_address);
+            }
+            break;
+        case 1:
+            // Next part of the image
+            result = ota_stream_write(cs->ota_handle, data_buffer, input_data_size);
+            break;
+        case 2:
+            // End of the image: verify what was written to the staging area
+            result = ota_stream_finish(cs->ota_handle);
+            break;
+        case 3:
+            // Install the verified image and reboot, after this reply is sent
+            result = ota_stream_activate(cs->ota_handle);
+            break;
+        default:
+            break;
+    }
+    return (int32_t) result;
+}
+
+static void comms_recv_callback(void *arg, struct udp_pcb *pcb,
+        struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    control_status_t* cs = (control_status_t *) arg;
+    if (!subscription_setting(cs, (const char*) p->payload, (size_t) p->len, addr, port)) {
+        (void) manual_setting(cs, (const char*) p->payload, (size_t) p->len);
+    }
+    pbuf_free(p);
 }
 
 static void config_init(control_status_t* cs) {
@@ -446,15 +952,43 @@ static void config_init(control_status_t* cs) {
         if (ipaddr_aton(address, &cs->config.report_addr)) {
             // Address is valid
             cs->config.report_port = config_get_int("report_port", 0, 0, UINT16_MAX);
-            cs->config.report_interval_s = config_get_int("report_interval_s", 1, 30, INT_MAX);
         }
     }
 
+    // format of reports sent by UDP (text, json or line)
+    cs->config.report_format = REPORT_FORMAT_TEXT;
+    char format[8];
+    size = sizeof(format) - 1;
+    if (wifi_settings_get_value_for_key("report_format", format, &size)) {
+        format[size] = '\0';
+        (void) report_parse_format(format, &cs->config.report_format);
+    }
+
+    // name of this device (used as a tag in line protocol reports)
+    size = sizeof(cs->config.report_name) - 1;
+    if (wifi_settings_get_value_for_key("name", cs->config.report_name, &size)) {
+        cs->config.report_name[size] = '\0';
+    }
+
+    // how often to consider sending a report; reports are suppressed if the
+    // temperature has changed by less than the deadband, unless the heartbeat
+    // interval is reached (a deadband of 0 means a report is sent every interval)
+    cs->config.report_interval_s = config_get_int("report_interval_s", 1, 30, INT_MAX);
+    cs->config.report_deadband = config_get_float("report_deadband", 0.0f);
+    cs->config.report_heartbeat_s = config_get_int("report_heartbeat_s", 1, cs->config.report_interval_s, INT_MAX);
+
     // where to listen for commands
     cs->config.control_port = config_get_int("control_port", 0, 0, UINT16_MAX);
 
+    // default lease for report subscriptions ("sub" command on the control port)
+    cs->config.subscription_lease_s = config_get_int("subscription_lease_s", 1, 600, MAX_SUBSCRIPTION_LEASE_S);
+
     // timeout for manual settings
     cs->config.manual_timeout_s = config_get_int("manual_timeout_s", 1, 60 * 60 * 24, INT_MAX);
+
+    // sample the temperature between 1Hz and 10Hz, with a shorter averaging window
+    // near the thresholds, rather than at a fixed 10Hz
+    cs->config.adaptive_sampling = config_get_int("adaptive_sampling", 0, 0, 1) != 0;
 }
 
 static void state_init(control_status_t* cs) {
@@ -464,6 +998,8 @@ static void state_init(control_status_t* cs) {
     cs->manual_mode = MODE_AUTO;
     cs->next_control_mode = CONTROL_OFF;
     cs->current_control_mode = CONTROL_OFF;
+    cs->boot_id = get_rand_32();
+    cs->snapshot_sequence = 1;
 
     // read config
     config_init(cs);
@@ -474,6 +1010,12 @@ static void state_init(control_status_t* cs) {
         udp_recv(cs->comms_pcb, comms_recv_callback, cs);
     }
 
+    // Time of day (SNTP) and schedule setup
+    cs->schedule_handle = schedule_init();
+
+    // Firmware update decoder
+    cs->ota_handle = ota_stream_init();
+
     // Temperature ADC setup
     cs->temperature_handle = temperature_init();
     while (!cs->temperature_handle) {
@@ -481,10 +1023,14 @@ static void state_init(control_status_t* cs) {
         sleep_ms(1000);
     }
     cs->external_temperature_value = temperature_external(cs->temperature_handle);
+    cs->reported_external_temperature_value = cs->external_temperature_value;
+    cs->reported_temperature_band = cs->temperature_band;
+    cs->reported_manual_mode = cs->manual_mode;
 
     // generate timeouts
     cs->control_mode_update_time = make_timeout_time_ms(cs->config.change_delay_s * 1000);
     cs->report_update_time = make_timeout_time_ms(cs->config.report_interval_s * 1000);
+    cs->report_heartbeat_time = make_timeout_time_ms(cs->config.report_heartbeat_s * 1000);
     cs->manual_mode_end_time = make_timeout_time_ms(cs->config.manual_timeout_s * 1000);
 }
 
@@ -521,6 +1067,7 @@ int main(void) {
     state_init(cs);
     wifi_settings_remote_set_handler(ID_GET_STATUS_HANDLER, remote_handler_get_status, cs);
     wifi_settings_remote_set_handler(ID_SET_RELAYS_HANDLER, remote_handler_set_relays, cs);
+    wifi_settings_remote_set_handler(ID_OTA_STREAM_HANDLER, remote_handler_ota_stream, cs);
     wifi_settings_connect();
 
     // main loop
@@ -528,7 +1075,19 @@ int main(void) {
     while (true) {
         uint32_t flags = save_and_disable_interrupts();
         periodic_task(cs);
+        if (cs->ota_handle) {
+            ota_stream_poll(cs->ota_handle);
+        }
+        const bool spectrum_request = cs->spectrum_request;
         restore_interrupts(flags);
+        if (spectrum_request) {
+            // Noise spectrum burst capture (see remote_handler_get_status), with
+            // interrupts enabled as it takes some time
+            temperature_spectrum_capture(cs->temperature_handle, cs->spectrum_request_hz);
+            flags = save_and_disable_interrupts();
+            cs->spectrum_request = false;
+            restore_interrupts(flags);
+        }
         sleep_until(update_time);
         update_time = delayed_by_ms(update_time, 100);
     }
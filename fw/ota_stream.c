@@ -0,0 +1,366 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system compressed and delta firmware updates
+ *
+ * This component receives a compressed firmware image, or a delta against
+ * the firmware that is currently running, and writes the decoded image into
+ * a staging area in Flash as the data arrives. Only one Flash page is
+ * buffered in RAM. When the image is complete and verified, it is copied
+ * over the current firmware and the device is rebooted.
+ *
+ * After the ota_header_t, the stream is a sequence of operations, each
+ * beginning with an opcode byte:
+ *
+ *   0x00..0x3f  literal: (opcode + 1) bytes follow
+ *   0x40..0x7f  copy from earlier in the output: length, then distance
+ *   0x80..0xbf  copy from the current firmware: length, then position
+ *
+ * For copies, the length is (opcode & 0x3f) + MIN_COPY, and if
+ * (opcode & 0x3f) == 0x3f, a varint follows which is added to the length.
+ * The distance is a varint (bytes back from the current output position).
+ * The position is a zigzag-encoded signed varint, relative to the current
+ * output position, so code that has moved by a fixed amount gives the same
+ * value repeatedly. Varints are 7 bits per byte, least significant first.
+ * 
+ */
+
+#include "ota_stream.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/time.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "hardware/structs/psm.h"
+#include "hardware/structs/watchdog.h"
+
+#define MIN_COPY            4
+#define LENGTH_EXTENDED     0x3f
+#define ACTIVATE_DELAY_MS   500         // time for the reply to the activate request to be sent
+
+// The staging area ends where the wifi-settings file begins. This is the
+// last 16kb of Flash, unless the wifi_settings library was built differently.
+// SETTINGS_AREA_SIZE must match SETTINGS_AREA_SIZE in rpc_pool.py.
+#define SETTINGS_AREA_SIZE  0x4000
+#ifndef OTA_SETTINGS_OFFSET
+#define OTA_SETTINGS_OFFSET (PICO_FLASH_SIZE_BYTES - SETTINGS_AREA_SIZE)
+#endif
+#define STAGING_LIMIT       OTA_SETTINGS_OFFSET
+
+typedef enum {
+    STATE_IDLE = 0,
+    STATE_OPCODE,
+    STATE_LENGTH,
+    STATE_ARGUMENT,
+    STATE_LITERAL,
+    STATE_COMPLETE,
+    STATE_VERIFIED,
+    STATE_ACTIVATING,
+    STATE_ERROR,
+} state_t;
+
+typedef enum {
+    COPY_OUTPUT = 1,
+    COPY_BASE = 2,
+} copy_t;
+
+typedef struct ota_stream_t {
+    ota_header_t        header;
+    state_t             state;
+    copy_t              copy;
+    uint32_t            staging_offset;     // Flash offset of the staging area
+    uint32_t            output_position;
+    uint32_t            length;
+    uint32_t            varint_value;
+    uint32_t            varint_shift;
+    uint32_t            firmware_size;      // size and CRC-32 of the current firmware
+    uint32_t            firmware_crc;
+    uint32_t            settings_crc;       // CRC-32 of the wifi-settings file
+    absolute_time_t     activate_time;      // when the verified image is installed
+    uint8_t*            activate_buffer;
+    uint8_t             page[FLASH_PAGE_SIZE];
+} ota_stream_t;
+
+extern char __flash_binary_end;
+
+
+static uint32_t crc32_update(uint32_t crc, const volatile uint8_t* data, uint32_t size) {
+    // CRC-32 (as zlib), using a 16-entry table to keep it small
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = ~crc;
+    for (uint32_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+    }
+    return ~crc;
+}
+
+static const volatile uint8_t* flash_pointer(uint32_t offset) {
+    return (const volatile uint8_t*) (XIP_BASE + offset);
+}
+
+static void program_page(ota_stream_t* o, uint32_t page_position) {
+    const uint32_t offset = o->staging_offset + page_position;
+    uint32_t flags = save_and_disable_interrupts();
+    if ((offset % FLASH_SECTOR_SIZE) == 0) {
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(offset, o->page, FLASH_PAGE_SIZE);
+    restore_interrupts(flags);
+}
+
+static void put_byte(ota_stream_t* o, uint8_t value) {
+    o->page[o->output_position % FLASH_PAGE_SIZE] = value;
+    o->output_position++;
+    if ((o->output_position % FLASH_PAGE_SIZE) == 0) {
+        program_page(o, o->output_position - FLASH_PAGE_SIZE);
+    }
+}
+
+static uint8_t get_output_byte(ota_stream_t* o, uint32_t position) {
+    // Bytes in the current page are still in RAM; earlier ones are in Flash
+    const uint32_t page_position = o->output_position - (o->output_position % FLASH_PAGE_SIZE);
+    if (position >= page_position) {
+        return o->page[position - page_position];
+    }
+    return flash_pointer(o->staging_offset)[position];
+}
+
+static bool copy_bytes(ota_stream_t* o, uint32_t argument) {
+    if (o->length > (o->header.output_size - o->output_position)) {
+        return false;
+    }
+    if (o->copy == COPY_OUTPUT) {
+        if ((argument == 0) || (argument > o->output_position)) {
+            return false;
+        }
+        // byte by byte, as the source may overlap the destination
+        const uint32_t source = o->output_position - argument;
+        for (uint32_t i = 0; i < o->length; i++) {
+            put_byte(o, get_output_byte(o, source + i));
+        }
+    } else {
+        const int32_t delta = (int32_t) (argument >> 1) ^ -(int32_t) (argument & 1);
+        const int64_t source = (int64_t) o->output_position + delta;
+        if ((source < 0) || ((source + o->length) > (int64_t) o->header.base_size)) {
+            return false;
+        }
+        const volatile uint8_t* base = flash_pointer((uint32_t) source);
+        for (uint32_t i = 0; i < o->length; i++) {
+            put_byte(o, base[i]);
+        }
+    }
+    return true;
+}
+
+static state_t next_opcode(ota_stream_t* o) {
+    return (o->output_position == o->header.output_size) ? STATE_COMPLETE : STATE_OPCODE;
+}
+
+static state_t decode_byte(ota_stream_t* o, uint8_t value) {
+    switch (o->state) {
+        case STATE_OPCODE:
+            if (value < 0x40) {
+                o->length = (uint32_t) value + 1;
+                if (o->length > (o->header.output_size - o->output_position)) {
+                    return STATE_ERROR;
+                }
+                return STATE_LITERAL;
+            } else if (value < 0xc0) {
+                o->copy = (value < 0x80) ? COPY_OUTPUT : COPY_BASE;
+                if ((o->copy == COPY_BASE) && !(o->header.flags & OTA_FLAG_DELTA)) {
+                    return STATE_ERROR;
+                }
+                o->length = (uint32_t) (value & 0x3f) + MIN_COPY;
+                o->varint_value = 0;
+                o->varint_shift = 0;
+                return ((value & 0x3f) == LENGTH_EXTENDED) ? STATE_LENGTH : STATE_ARGUMENT;
+            }
+            return STATE_ERROR;
+        case STATE_LENGTH:
+        case STATE_ARGUMENT:
+            if (o->varint_shift > 28) {
+                return STATE_ERROR;
+            }
+            o->varint_value |= (uint32_t) (value & 0x7f) << o->varint_shift;
+            o->varint_shift += 7;
+            if (value & 0x80) {
+                return o->state;    // more bytes to come
+            }
+            if (o->state == STATE_LENGTH) {
+                o->length += o->varint_value;
+                o->varint_value = 0;
+                o->varint_shift = 0;
+                return STATE_ARGUMENT;
+            }
+            if (!copy_bytes(o, o->varint_value)) {
+                return STATE_ERROR;
+            }
+            return next_opcode(o);
+        case STATE_LITERAL:
+            put_byte(o, value);
+            o->length--;
+            return (o->length == 0) ? next_opcode(o) : STATE_LITERAL;
+        default:
+            return STATE_ERROR;
+    }
+}
+
+struct ota_stream_t* ota_stream_init(void) {
+    ota_stream_t* o = calloc(1, sizeof(ota_stream_t));
+    if (!o) {
+        return NULL;
+    }
+    // The staging area begins after the current firmware
+    const uint32_t binary_end = (uint32_t) ((uintptr_t) &__flash_binary_end - XIP_BASE);
+    o->staging_offset = (binary_end + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    o->state = STATE_IDLE;
+
+    // Identify the firmware and settings, so that an update can be confirmed:
+    // the firmware CRC matches main.bin, and the settings CRC matches the
+    // wifi-settings file (which ends at the first 0x00 or 0xff byte, or at
+    // the end of the settings area)
+    o->firmware_size = binary_end;
+    o->firmware_crc = crc32_update(0, flash_pointer(0), binary_end);
+    const volatile uint8_t* settings = flash_pointer(STAGING_LIMIT);
+    uint32_t settings_size = 0;
+    while ((settings_size < SETTINGS_AREA_SIZE)
+    && (settings[settings_size] != 0x00) && (settings[settings_size] != 0xff)) {
+        settings_size++;
+    }
+    o->settings_crc = crc32_update(0, settings, settings_size);
+    return o;
+}
+
+uint32_t ota_stream_firmware_size(const struct ota_stream_t* o) {
+    return o->firmware_size;
+}
+
+uint32_t ota_stream_firmware_crc(const struct ota_stream_t* o) {
+    return o->firmware_crc;
+}
+
+uint32_t ota_stream_settings_crc(const struct ota_stream_t* o) {
+    return o->settings_crc;
+}
+
+ota_result_t ota_stream_begin(struct ota_stream_t* o, const void* header, uint32_t header_size,
+                              uint32_t* staging_address) {
+    if (o->state == STATE_ACTIVATING) {
+        return OTA_ERROR_STATE;
+    }
+    o->state = STATE_ERROR;
+    if (header_size < sizeof(ota_header_t)) {
+        return OTA_ERROR_HEADER;
+    }
+    memcpy(&o->header, header, sizeof(ota_header_t));
+    if ((o->header.magic != OTA_MAGIC) || (o->header.version != OTA_VERSION)
+    || (o->header.output_size == 0)) {
+        return OTA_ERROR_HEADER;
+    }
+    if (o->header.output_size > (STAGING_LIMIT - o->staging_offset)) {
+        return OTA_ERROR_SIZE;
+    }
+    if (o->header.flags & OTA_FLAG_DELTA) {
+        // The delta must be applied to the firmware it was made from
+        if ((o->header.base_size > o->staging_offset)
+        || (crc32_update(0, flash_pointer(0), o->header.base_size) != o->header.base_crc)) {
+            return OTA_ERROR_BASE;
+        }
+    }
+    o->output_position = 0;
+    o->state = STATE_OPCODE;
+    *staging_address = XIP_BASE + o->staging_offset;
+    return OTA_OK;
+}
+
+ota_result_t ota_stream_write(struct ota_stream_t* o, const uint8_t* data, uint32_t size) {
+    if (o->state == STATE_ACTIVATING) {
+        return OTA_ERROR_STATE;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        if (o->state == STATE_COMPLETE) {
+            // unexpected data after the end of the image
+            o->state = STATE_ERROR;
+        }
+        if (o->state == STATE_ERROR) {
+            return OTA_ERROR_STREAM;
+        }
+        o->state = decode_byte(o, data[i]);
+    }
+    return (o->state == STATE_ERROR) ? OTA_ERROR_STREAM : OTA_OK;
+}
+
+ota_result_t ota_stream_finish(struct ota_stream_t* o) {
+    if (o->state == STATE_ACTIVATING) {
+        return OTA_ERROR_STATE;
+    }
+    if (o->state != STATE_COMPLETE) {
+        o->state = STATE_ERROR;
+        return OTA_ERROR_STATE;
+    }
+    // Write the final partial page, then check what is actually in Flash
+    const uint32_t remainder = o->output_position % FLASH_PAGE_SIZE;
+    if (remainder != 0) {
+        memset(&o->page[remainder], 0xff, FLASH_PAGE_SIZE - remainder);
+        program_page(o, o->output_position - remainder);
+    }
+    if (crc32_update(0, flash_pointer(o->staging_offset), o->header.output_size) != o->header.output_crc) {
+        o->state = STATE_ERROR;
+        return OTA_ERROR_CRC;
+    }
+    o->state = STATE_VERIFIED;
+    return OTA_OK;
+}
+
+static void __not_in_flash_func(copy_and_reboot)(uint32_t staging_offset, uint32_t size, uint8_t* buffer) {
+    // Nothing in Flash can be used once the first sector is erased, so this
+    // function runs from RAM, and copies with volatile pointers to avoid calls to memcpy.
+    // The staging area is after the destination, so copying in ascending order is safe.
+    volatile uint8_t* copy = buffer;
+    for (uint32_t offset = 0; offset < size; offset += FLASH_SECTOR_SIZE) {
+        const volatile uint8_t* source = (const volatile uint8_t*) (XIP_BASE + staging_offset + offset);
+        for (uint32_t i = 0; i < FLASH_SECTOR_SIZE; i++) {
+            copy[i] = source[i];
+        }
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        flash_range_program(offset, buffer, FLASH_SECTOR_SIZE);
+    }
+    watchdog_hw->ctrl = WATCHDOG_CTRL_TRIGGER_BITS;
+    while (true) {}
+}
+
+ota_result_t ota_stream_activate(struct ota_stream_t* o) {
+    // This is called by the remote handler, which must reply before the device
+    // reboots, so the image is installed later by ota_stream_poll
+    if (o->state != STATE_VERIFIED) {
+        return OTA_ERROR_STATE;
+    }
+    o->activate_buffer = malloc(FLASH_SECTOR_SIZE);
+    if (!o->activate_buffer) {
+        return OTA_ERROR_STATE;
+    }
+    o->activate_time = make_timeout_time_ms(ACTIVATE_DELAY_MS);
+    o->state = STATE_ACTIVATING;
+    return OTA_OK;
+}
+
+void ota_stream_poll(struct ota_stream_t* o) {
+    if ((o->state != STATE_ACTIVATING) || !time_reached(o->activate_time)) {
+        return;
+    }
+    // watchdog reset should reset everything except the oscillators (as watchdog_reboot)
+    hw_set_bits(&psm_hw->wdsel, PSM_WDSEL_BITS & ~(PSM_WDSEL_ROSC_BITS | PSM_WDSEL_XOSC_BITS));
+    (void) save_and_disable_interrupts();
+    copy_and_reboot(o->staging_offset, o->header.output_size, o->activate_buffer);
+}
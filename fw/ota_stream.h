@@ -0,0 +1,61 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system compressed and delta firmware updates
+ *
+ * This component receives a compressed firmware image, or a delta against
+ * the firmware that is currently running, and writes the decoded image into
+ * a staging area in Flash as the data arrives. Only one Flash page is
+ * buffered in RAM. When the image is complete and verified, it is copied
+ * over the current firmware and the device is rebooted. Activation is
+ * deferred (see ota_stream_poll) so that the request can be answered first.
+ *
+ * The images are produced by ota_pack.py.
+ * 
+ */
+#ifndef OTA_STREAM_H
+#define OTA_STREAM_H
+
+#include <stdint.h>
+
+#define OTA_MAGIC           0x41544f56  // "VOTA"
+#define OTA_VERSION         1
+#define OTA_FLAG_DELTA      1
+
+typedef struct __attribute__((packed)) ota_header_t {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    flags;
+    uint32_t    output_size;        // size of the decoded image
+    uint32_t    output_crc;         // CRC-32 of the decoded image
+    uint32_t    base_size;          // delta only: size of the image it is based on
+    uint32_t    base_crc;           // delta only: CRC-32 of the image it is based on
+} ota_header_t;
+
+typedef enum {
+    OTA_OK = 0,
+    OTA_ERROR_HEADER,       // header is not valid
+    OTA_ERROR_BASE,         // delta does not match the current firmware
+    OTA_ERROR_SIZE,         // image is too large for the staging area
+    OTA_ERROR_STREAM,       // compressed data is not valid
+    OTA_ERROR_CRC,          // decoded image does not match the header
+    OTA_ERROR_STATE,        // operation not valid at this point
+} ota_result_t;
+
+struct ota_stream_t;
+struct ota_stream_t* ota_stream_init(void);
+ota_result_t ota_stream_begin(struct ota_stream_t* o, const void* header, uint32_t header_size,
+                              uint32_t* staging_address);
+ota_result_t ota_stream_write(struct ota_stream_t* o, const uint8_t* data, uint32_t size);
+ota_result_t ota_stream_finish(struct ota_stream_t* o);
+ota_result_t ota_stream_activate(struct ota_stream_t* o);
+// Called from the main loop: installs the image and reboots, shortly after activation
+void ota_stream_poll(struct ota_stream_t* o);
+uint32_t ota_stream_firmware_size(const struct ota_stream_t* o);
+uint32_t ota_stream_firmware_crc(const struct ota_stream_t* o);
+uint32_t ota_stream_settings_crc(const struct ota_stream_t* o);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system packed sample ring buffer
+ *
+ * This component stores 12-bit ADC samples in a ring buffer, packing
+ * two samples into every three bytes. When the buffer is full, the oldest
+ * samples are overwritten. A reader position tracks the samples that have
+ * not yet been read.
+ * 
+ */
+
+#include "packed_ring.h"
+
+// Each pair of samples (a, b) is stored as three bytes:
+//   byte 0: a bits 0..7
+//   byte 1: a bits 8..11 (low nibble), b bits 0..3 (high nibble)
+//   byte 2: b bits 4..11
+
+static void set_sample(uint8_t* data, uint32_t position, uint16_t value) {
+    uint8_t* pair = &data[(position >> 1) * 3];
+    value &= 0xfff;
+    if ((position & 1) == 0) {
+        pair[0] = (uint8_t) value;
+        pair[1] = (uint8_t) ((pair[1] & 0xf0) | (value >> 8));
+    } else {
+        pair[1] = (uint8_t) ((pair[1] & 0x0f) | (value << 4));
+        pair[2] = (uint8_t) (value >> 4);
+    }
+}
+
+static uint16_t get_sample(const uint8_t* data, uint32_t position) {
+    const uint8_t* pair = &data[(position >> 1) * 3];
+    if ((position & 1) == 0) {
+        return (uint16_t) (pair[0] | ((pair[1] & 0x0f) << 8));
+    } else {
+        return (uint16_t) ((pair[1] >> 4) | (pair[2] << 4));
+    }
+}
+
+static uint32_t oldest_position(const packed_ring_t* ring, uint32_t count) {
+    // position of the sample "count" places before the head
+    return (ring->head >= count) ? (ring->head - count) : (ring->head + ring->capacity - count);
+}
+
+void packed_ring_init(packed_ring_t* ring, uint8_t* data, uint32_t capacity) {
+    ring->data = data;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->unread = 0;
+    ring->lost = 0;
+}
+
+void packed_ring_append(packed_ring_t* ring, uint16_t value) {
+    set_sample(ring->data, ring->head, value);
+    ring->head++;
+    if (ring->head >= ring->capacity) {
+        ring->head = 0;
+    }
+    if (ring->unread < ring->capacity) {
+        ring->unread++;
+    } else {
+        ring->lost++;
+    }
+}
+
+uint32_t packed_ring_read(packed_ring_t* ring, void* payload, uint32_t max_count) {
+    uint8_t* out = (uint8_t*) payload;
+    const uint32_t count = (ring->unread < max_count) ? ring->unread : max_count;
+    uint32_t position = oldest_position(ring, ring->unread);
+    for (uint32_t i = 0; i < count; i++) {
+        const uint16_t value = get_sample(ring->data, position);
+        out[(i * 2) + 0] = (uint8_t) value;
+        out[(i * 2) + 1] = (uint8_t) (value >> 8);
+        position++;
+        if (position >= ring->capacity) {
+            position = 0;
+        }
+    }
+    ring->unread -= count;
+    return count;
+}
@@ -0,0 +1,37 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system packed sample ring buffer
+ *
+ * This component stores 12-bit ADC samples in a ring buffer, packing
+ * two samples into every three bytes. When the buffer is full, the oldest
+ * samples are overwritten. A reader position tracks the samples that have
+ * not yet been read.
+ * 
+ */
+#ifndef PACKED_RING_H
+#define PACKED_RING_H
+
+#include <stdint.h>
+
+// Storage needed for "capacity" samples (capacity must be even)
+#define PACKED_RING_BYTES(capacity) (((capacity) / 2) * 3)
+
+typedef struct packed_ring_t {
+    uint8_t*    data;
+    uint32_t    capacity;   // number of samples
+    uint32_t    head;       // position of the next sample to be written
+    uint32_t    unread;     // number of samples not yet read
+    uint32_t    lost;       // number of samples overwritten before they were read
+} packed_ring_t;
+
+void packed_ring_init(packed_ring_t* ring, uint8_t* data, uint32_t capacity);
+void packed_ring_append(packed_ring_t* ring, uint16_t value);
+// Copies up to max_count of the oldest unread samples to payload, as 16-bit little-endian
+// values, and marks them as read. Returns the number copied.
+uint32_t packed_ring_read(packed_ring_t* ring, void* payload, uint32_t max_count);
+
+#endif
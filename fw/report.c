@@ -0,0 +1,242 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system report serialiser
+ *
+ * This component formats status reports without using printf. A report
+ * is a sequence of named fields, and a serialiser turns these into
+ * one of several output formats: the original text line, JSON, or
+ * the line protocol used by time-series databases such as InfluxDB.
+ *
+ * Temperatures are passed as fixed-point values (tenths of a degree)
+ * so no floating-point formatting is required.
+ * 
+ */
+
+#include "report.h"
+
+#include <string.h>
+
+#define MEASUREMENT_NAME    "ventilation"
+
+typedef enum {
+    FIELD_NUMBER = 0,       // already formatted as digits
+    FIELD_INTEGER,          // digits, but line protocol needs an "i" suffix
+    FIELD_TEXT,             // needs quotes in JSON and line protocol
+} field_type_t;
+
+typedef struct report_serialiser_t {
+    void (*begin)(report_writer_t* w, const char* name);
+    void (*field)(report_writer_t* w, const char* key, const char* value, field_type_t type);
+    void (*end)(report_writer_t* w, uint32_t unix_time);
+} report_serialiser_t;
+
+
+static void append(report_writer_t* w, const char* text) {
+    // Output is truncated if it does not fit
+    while (text[0] != '\0') {
+        if ((w->length + 1) >= w->size) {
+            w->truncated = true;
+            return;
+        }
+        w->message[w->length] = text[0];
+        w->length++;
+        text++;
+    }
+}
+
+static void append_char(report_writer_t* w, char ch) {
+    const char text[2] = {ch, '\0'};
+    append(w, text);
+}
+
+// Format values into the end of "buffer", returning a pointer to the first character
+static const char* format_uint64(uint64_t value, char* buffer, size_t size) {
+    char* p = &buffer[size - 1];
+    *p = '\0';
+    do {
+        p--;
+        *p = (char) ('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+    return p;
+}
+
+// Format a value in tenths as e.g. "-12.3"
+static const char* format_decimal(int16_t value, char* buffer, size_t size) {
+    const bool negative = value < 0;
+    uint32_t magnitude = negative ? (uint32_t) (-(int32_t) value) : (uint32_t) value;
+    char* p = &buffer[size - 1];
+    *p = '\0';
+    p--;
+    *p = (char) ('0' + (magnitude % 10));
+    p--;
+    *p = '.';
+    magnitude /= 10;
+    do {
+        p--;
+        *p = (char) ('0' + (magnitude % 10));
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative) {
+        p--;
+        *p = '-';
+    }
+    return p;
+}
+
+// Original text format
+static void text_begin(report_writer_t* w, const char* name) {
+}
+
+static void text_field(report_writer_t* w, const char* key, const char* value, field_type_t type) {
+    if (w->num_fields != 0) {
+        append_char(w, ' ');
+    }
+    append(w, key);
+    append_char(w, ' ');
+    append(w, value);
+}
+
+static void text_end(report_writer_t* w, uint32_t unix_time) {
+    append_char(w, '\n');
+}
+
+// JSON
+static void json_begin(report_writer_t* w, const char* name) {
+    append_char(w, '{');
+}
+
+static void json_field(report_writer_t* w, const char* key, const char* value, field_type_t type) {
+    if (w->num_fields != 0) {
+        append_char(w, ',');
+    }
+    append_char(w, '"');
+    append(w, key);
+    append(w, "\":");
+    if (type == FIELD_TEXT) {
+        append_char(w, '"');
+        append(w, value);
+        append_char(w, '"');
+    } else {
+        append(w, value);
+    }
+}
+
+static void json_end(report_writer_t* w, uint32_t unix_time) {
+    if (unix_time != 0) {
+        char buffer[24];
+        json_field(w, "time", format_uint64(unix_time, buffer, sizeof(buffer)), FIELD_NUMBER);
+    }
+    append(w, "}\n");
+}
+
+// Time-series database line protocol: measurement,tags fields timestamp
+static void line_begin(report_writer_t* w, const char* name) {
+    append(w, MEASUREMENT_NAME);
+    if (name && name[0]) {
+        append(w, ",host=");
+        // spaces and commas must be escaped in tag values
+        for (; name[0] != '\0'; name++) {
+            if ((name[0] == ' ') || (name[0] == ',') || (name[0] == '=')) {
+                append_char(w, '\\');
+            }
+            append_char(w, name[0]);
+        }
+    }
+    append_char(w, ' ');
+}
+
+static void line_field(report_writer_t* w, const char* key, const char* value, field_type_t type) {
+    if (w->num_fields != 0) {
+        append_char(w, ',');
+    }
+    append(w, key);
+    append_char(w, '=');
+    if (type == FIELD_TEXT) {
+        append_char(w, '"');
+        append(w, value);
+        append_char(w, '"');
+    } else {
+        append(w, value);
+        if (type == FIELD_INTEGER) {
+            append_char(w, 'i');
+        }
+    }
+}
+
+static void line_end(report_writer_t* w, uint32_t unix_time) {
+    if (unix_time != 0) {
+        // timestamp in nanoseconds; without this, the server uses the time of arrival
+        char buffer[24];
+        append_char(w, ' ');
+        append(w, format_uint64((uint64_t) unix_time * 1000000000ULL, buffer, sizeof(buffer)));
+    }
+    append_char(w, '\n');
+}
+
+static const report_serialiser_t g_serialisers[] = {
+    [REPORT_FORMAT_TEXT] = {text_begin, text_field, text_end},
+    [REPORT_FORMAT_JSON] = {json_begin, json_field, json_end},
+    [REPORT_FORMAT_LINE_PROTOCOL] = {line_begin, line_field, line_end},
+};
+
+void report_begin(report_writer_t* w, report_format_t format, const char* name, char* message, size_t size) {
+    if ((unsigned) format >= (sizeof(g_serialisers) / sizeof(g_serialisers[0]))) {
+        format = REPORT_FORMAT_TEXT;
+    }
+    w->message = message;
+    w->size = size;
+    w->length = 0;
+    w->num_fields = 0;
+    w->truncated = false;
+    w->serialiser = &g_serialisers[format];
+    if (size != 0) {
+        message[0] = '\0';
+    }
+    w->serialiser->begin(w, name);
+}
+
+void report_add_decicelsius(report_writer_t* w, const char* key, int16_t value_dc) {
+    char buffer[12];
+    w->serialiser->field(w, key, format_decimal(value_dc, buffer, sizeof(buffer)), FIELD_NUMBER);
+    w->num_fields++;
+}
+
+void report_add_uint(report_writer_t* w, const char* key, uint32_t value) {
+    char buffer[12];
+    w->serialiser->field(w, key, format_uint64(value, buffer, sizeof(buffer)), FIELD_INTEGER);
+    w->num_fields++;
+}
+
+void report_add_text(report_writer_t* w, const char* key, const char* value) {
+    w->serialiser->field(w, key, value, FIELD_TEXT);
+    w->num_fields++;
+}
+
+size_t report_end(report_writer_t* w, uint32_t unix_time) {
+    w->serialiser->end(w, unix_time);
+    if (w->truncated) {
+        w->length = 0;
+    }
+    if (w->size != 0) {
+        w->message[w->length] = '\0';
+    }
+    return w->length;
+}
+
+bool report_parse_format(const char* name, report_format_t* format) {
+    if (strcmp(name, "text") == 0) {
+        *format = REPORT_FORMAT_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = REPORT_FORMAT_JSON;
+    } else if (strcmp(name, "line") == 0) {
+        *format = REPORT_FORMAT_LINE_PROTOCOL;
+    } else {
+        return false;
+    }
+    return true;
+}
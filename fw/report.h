@@ -0,0 +1,50 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system report serialiser
+ *
+ * This component formats status reports without using printf. A report
+ * is a sequence of named fields, and a serialiser turns these into
+ * one of several output formats: the original text line, JSON, or
+ * the line protocol used by time-series databases such as InfluxDB.
+ * 
+ */
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+    REPORT_FORMAT_TEXT = 0,         // ext 21.5 int 30.1 control ON ...
+    REPORT_FORMAT_JSON,             // {"ext":21.5,"int":30.1,"control":"ON",...}
+    REPORT_FORMAT_LINE_PROTOCOL,    // ventilation,host=name ext=21.5,int=30.1,control="ON",... timestamp
+} report_format_t;
+
+typedef struct report_writer_t {
+    char*                       message;
+    size_t                      size;
+    size_t                      length;
+    unsigned                    num_fields;
+    bool                        truncated;          // the message did not fit
+    const struct report_serialiser_t* serialiser;
+} report_writer_t;
+
+// Begin a report in the given format. "name" is used as a tag (line protocol only).
+void report_begin(report_writer_t* w, report_format_t format, const char* name, char* message, size_t size);
+void report_add_decicelsius(report_writer_t* w, const char* key, int16_t value_dc);
+void report_add_uint(report_writer_t* w, const char* key, uint32_t value);
+void report_add_text(report_writer_t* w, const char* key, const char* value);
+// End the report. unix_time is used as a timestamp (line protocol only) if non-zero.
+// Returns the length of the message, which is always terminated by '\0',
+// or 0 if the message did not fit (a truncated message must not be sent).
+size_t report_end(report_writer_t* w, uint32_t unix_time);
+
+// Get the format from a name (text, json, line); returns false if not recognised
+bool report_parse_format(const char* name, report_format_t* format);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system schedule
+ *
+ * This component gets the time of day by SNTP and applies a table of
+ * rules from the wifi-settings file, e.g. "boost after sunset". Each rule
+ * is a time of day and a command (the same commands as the control port).
+ * The time of the next transition is computed once, so the main loop only
+ * needs to check whether that time has been reached.
+ *
+ * Rules are given as "schedule1=<time> <mode>", "schedule2=...", etc.
+ * <time> is "HH:MM" (local time), "sunrise" or "sunset", optionally followed
+ * by an offset in minutes, e.g. "sunset+30". <mode> is auto, dark, on, off
+ * or boost. Each rule stays in effect until the next one.
+ * 
+ */
+
+#include "schedule.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "lwip/apps/sntp.h"
+
+#include "wifi_settings.h"
+#include "config.h"
+
+#define MAX_RULES           16
+#define MAX_COMMAND_SIZE    12
+#define SECONDS_PER_DAY     (24 * 60 * 60)
+#define DEFAULT_SNTP_SERVER "pool.ntp.org"
+#define PI_F                3.14159265f
+#define DEG_TO_RAD          (PI_F / 180.0f)
+
+typedef enum {
+    RULE_FIXED = 0,     // minutes after local midnight
+    RULE_SUNRISE,       // minutes after sunrise
+    RULE_SUNSET,        // minutes after sunset
+} rule_type_t;
+
+typedef struct rule_t {
+    uint8_t             type;
+    int16_t             minutes;
+    char                command[MAX_COMMAND_SIZE];
+} rule_t;
+
+typedef struct schedule_t {
+    rule_t              rules[MAX_RULES];
+    int                 num_rules;
+    int                 active_rule;
+    int                 utc_offset_min;
+    bool                dst;
+    float               latitude;
+    float               longitude;
+    char                sntp_server[64];
+    bool                time_valid;
+    bool                apply_active_rule;
+    int64_t             unix_offset_us;         // unix time minus time since boot
+    uint32_t            next_transition;        // unix time of the next rule
+    absolute_time_t     deadline;
+} schedule_t;
+
+// There is only one clock, so the schedule is a singleton, which
+// allows the SNTP callback to find it.
+static schedule_t g_schedule;
+
+static const char* const g_modes[] = {"auto", "dark", "on", "off", "boost"};
+
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar
+static int32_t days_from_civil(int32_t y, int32_t m, int32_t d) {
+    y -= (m <= 2) ? 1 : 0;
+    const int32_t era = (y >= 0 ? y : y - 399) / 400;
+    const int32_t yoe = y - (era * 400);
+    const int32_t doy = ((153 * (m + ((m > 2) ? -3 : 9))) + 2) / 5 + d - 1;
+    const int32_t doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+    return (era * 146097) + doe - 719468;
+}
+
+static int32_t year_from_days(int32_t days) {
+    const int32_t z = days + 719468;
+    const int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const int32_t doe = z - (era * 146097);
+    const int32_t yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+    const int32_t doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+    const int32_t mp = ((5 * doy) + 2) / 153;
+    const int32_t m = mp + ((mp < 10) ? 3 : -9);
+    return yoe + (era * 400) + ((m <= 2) ? 1 : 0);
+}
+
+static int32_t floor_div(int64_t a, int32_t b) {
+    int64_t q = a / b;
+    if ((a % b) < 0) {
+        q--;
+    }
+    return (int32_t) q;
+}
+
+static int32_t last_sunday(int32_t year, int32_t month) {
+    // 1970-01-01 was a Thursday, so (days + 4) % 7 is 0 for Sunday
+    const int32_t last_day = days_from_civil(year, month + 1, 1) - 1;
+    return last_day - ((last_day + 4) % 7);
+}
+
+// Offset from UTC to local time at a given unix time, including
+// European summer time (from 01:00 UTC on the last Sunday in March
+// until 01:00 UTC on the last Sunday in October) if enabled
+static int32_t local_offset_s(const schedule_t* s, int64_t unix_time) {
+    int32_t offset = s->utc_offset_min * 60;
+    if (s->dst) {
+        const int32_t year = year_from_days(floor_div(unix_time, SECONDS_PER_DAY));
+        const int64_t start = ((int64_t) last_sunday(year, 3) * SECONDS_PER_DAY) + 3600;
+        const int64_t end = ((int64_t) last_sunday(year, 10) * SECONDS_PER_DAY) + 3600;
+        if ((unix_time >= start) && (unix_time < end)) {
+            offset += 3600;
+        }
+    }
+    return offset;
+}
+
+// Approximate time of sunrise or sunset (NOAA simplified equations),
+// returned in minutes after midnight UTC
+static float sun_event_minutes_utc(const schedule_t* s, int32_t days, bool sunset) {
+    const int32_t year = year_from_days(days);
+    const float day_of_year = (float) (days - days_from_civil(year, 1, 1) + 1);
+    const float declination = 23.44f * DEG_TO_RAD * sinf(2.0f * PI_F * (284.0f + day_of_year) / 365.0f);
+    const float b = 2.0f * PI_F * (day_of_year - 81.0f) / 364.0f;
+    const float equation_of_time = (9.87f * sinf(2.0f * b)) - (7.53f * cosf(b)) - (1.5f * sinf(b));
+    const float latitude = s->latitude * DEG_TO_RAD;
+    float cos_hour_angle = (sinf(-0.833f * DEG_TO_RAD) - (sinf(latitude) * sinf(declination)))
+                            / (cosf(latitude) * cosf(declination));
+    // clamp for polar day / night
+    cos_hour_angle = fmaxf(-1.0f, fminf(1.0f, cos_hour_angle));
+    const float hour_angle_deg = acosf(cos_hour_angle) / DEG_TO_RAD;
+    const float solar_noon = 720.0f - (4.0f * s->longitude) - equation_of_time;
+    return solar_noon + ((sunset ? 4.0f : -4.0f) * hour_angle_deg);
+}
+
+// Unix time at which a rule takes effect on a given local day
+static int64_t rule_time(const schedule_t* s, const rule_t* rule, int32_t local_days) {
+    if (rule->type == RULE_FIXED) {
+        const int64_t local_time = ((int64_t) local_days * SECONDS_PER_DAY) + ((int64_t) rule->minutes * 60);
+        return local_time - local_offset_s(s, local_time - (s->utc_offset_min * 60));
+    }
+    const float minutes = sun_event_minutes_utc(s, local_days, rule->type == RULE_SUNSET);
+    return ((int64_t) local_days * SECONDS_PER_DAY) + (int64_t) ((minutes + (float) rule->minutes) * 60.0f);
+}
+
+static bool parse_rule(const char* text, rule_t* rule) {
+    const char* p = text;
+    char* end = NULL;
+    memset(rule, 0, sizeof(rule_t));
+    if (strncmp(p, "sunrise", 7) == 0) {
+        rule->type = RULE_SUNRISE;
+        p += 7;
+    } else if (strncmp(p, "sunset", 6) == 0) {
+        rule->type = RULE_SUNSET;
+        p += 6;
+    } else {
+        // HH:MM
+        const long hours = strtol(p, &end, 10);
+        if ((end == p) || (end[0] != ':') || (hours < 0) || (hours > 23)) {
+            return false;
+        }
+        p = end + 1;
+        const long minutes = strtol(p, &end, 10);
+        if ((end == p) || (minutes < 0) || (minutes > 59)) {
+            return false;
+        }
+        rule->type = RULE_FIXED;
+        rule->minutes = (int16_t) ((hours * 60) + minutes);
+        p = end;
+    }
+    if ((rule->type != RULE_FIXED) && ((p[0] == '+') || (p[0] == '-'))) {
+        // offset in minutes
+        const long offset = strtol(p, &end, 10);
+        if ((end == p) || (offset < -720) || (offset > 720)) {
+            return false;
+        }
+        rule->minutes = (int16_t) offset;
+        p = end;
+    }
+    if (p[0] != ' ') {
+        return false;
+    }
+    while (p[0] == ' ') {
+        p++;
+    }
+    for (uint i = 0; i < (sizeof(g_modes) / sizeof(g_modes[0])); i++) {
+        if (strcmp(p, g_modes[i]) == 0) {
+            strcpy(rule->command, "piv ");
+            strcat(rule->command, g_modes[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+struct schedule_t* schedule_init(void) {
+    schedule_t* s = &g_schedule;
+    memset(s, 0, sizeof(schedule_t));
+    s->active_rule = -1;
+    s->apply_active_rule = true;
+    s->deadline = at_the_end_of_time;
+
+    // read the rules: schedule1, schedule2, ...
+    for (int i = 1; i <= MAX_RULES; i++) {
+        char key[16];
+        char value[32];
+        uint size = sizeof(value) - 1;
+        snprintf(key, sizeof(key), "schedule%d", i);
+        if (wifi_settings_get_value_for_key(key, value, &size)) {
+            value[size] = '\0';
+            if (parse_rule(value, &s->rules[s->num_rules])) {
+                s->num_rules++;
+            }
+        }
+    }
+
+    // time zone and location (for sunrise and sunset)
+    s->utc_offset_min = config_get_int("utc_offset_min", -24 * 60, 0, 24 * 60);
+    s->dst = config_get_int("dst", 0, 0, 1) != 0;
+    s->latitude = config_get_float("latitude", 51.5f);
+    s->longitude = config_get_float("longitude", 0.0f);
+
+    // start SNTP if there is a schedule, or if a server is specified
+    uint size = sizeof(s->sntp_server) - 1;
+    if (wifi_settings_get_value_for_key("sntp_server", s->sntp_server, &size)) {
+        s->sntp_server[size] = '\0';
+    } else if (s->num_rules > 0) {
+        strcpy(s->sntp_server, DEFAULT_SNTP_SERVER);
+    }
+    if (s->sntp_server[0]) {
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, s->sntp_server);
+        sntp_init();
+    }
+    return s;
+}
+
+void schedule_set_unix_time(uint32_t unix_time_s) {
+    schedule_t* s = &g_schedule;
+    s->unix_offset_us = ((int64_t) unix_time_s * 1000000LL) - (int64_t) time_us_64();
+    s->time_valid = true;
+    if (s->num_rules > 0) {
+        // recompute the next transition
+        s->deadline = nil_time;
+    }
+}
+
+bool schedule_due(const struct schedule_t* s) {
+    return time_reached(s->deadline);
+}
+
+uint32_t schedule_unix_time(const struct schedule_t* s) {
+    if (!s->time_valid) {
+        return 0;
+    }
+    return (uint32_t) (((int64_t) time_us_64() + s->unix_offset_us) / 1000000LL);
+}
+
+uint32_t schedule_next_transition(const struct schedule_t* s) {
+    return s->next_transition;
+}
+
+int schedule_active_rule(const struct schedule_t* s) {
+    return s->active_rule;
+}
+
+int schedule_num_rules(const struct schedule_t* s) {
+    return s->num_rules;
+}
+
+const char* schedule_update(struct schedule_t* s, absolute_time_t* until) {
+    s->deadline = at_the_end_of_time;
+    if ((!s->time_valid) || (s->num_rules == 0)) {
+        return NULL;
+    }
+
+    // A transition was reached (rather than just an SNTP update)
+    const int64_t now = (int64_t) schedule_unix_time(s);
+    if (s->next_transition && (now >= (int64_t) s->next_transition)) {
+        s->apply_active_rule = true;
+    }
+
+    // Find the most recent rule (yesterday or today) and the next one (today or tomorrow)
+    const int32_t today = floor_div(now + local_offset_s(s, now), SECONDS_PER_DAY);
+    int64_t active_time = INT64_MIN;
+    int64_t next_time = INT64_MAX;
+    int active_rule = -1;
+    for (int32_t day = today - 1; day <= (today + 1); day++) {
+        for (int i = 0; i < s->num_rules; i++) {
+            const int64_t t = rule_time(s, &s->rules[i], day);
+            if ((t <= now) && (t > active_time)) {
+                active_time = t;
+                active_rule = i;
+            } else if ((t > now) && (t < next_time)) {
+                next_time = t;
+            }
+        }
+    }
+
+    s->active_rule = active_rule;
+    s->next_transition = (uint32_t) next_time;
+    s->deadline = from_us_since_boot((uint64_t) ((next_time * 1000000LL) - s->unix_offset_us));
+    *until = s->deadline;
+
+    if (s->apply_active_rule && (active_rule >= 0)) {
+        s->apply_active_rule = false;
+        return s->rules[active_rule].command;
+    }
+    return NULL;
+}
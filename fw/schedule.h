@@ -0,0 +1,36 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system schedule
+ *
+ * This component gets the time of day by SNTP and applies a table of
+ * rules from the wifi-settings file, e.g. "boost after sunset". Each rule
+ * is a time of day and a command (the same commands as the control port).
+ * The time of the next transition is computed once, so the main loop only
+ * needs to check whether that time has been reached.
+ * 
+ */
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+
+struct schedule_t;
+struct schedule_t* schedule_init(void);
+bool schedule_due(const struct schedule_t* s);
+const char* schedule_update(struct schedule_t* s, absolute_time_t* until);
+uint32_t schedule_unix_time(const struct schedule_t* s);
+uint32_t schedule_next_transition(const struct schedule_t* s);
+int schedule_active_rule(const struct schedule_t* s);
+int schedule_num_rules(const struct schedule_t* s);
+
+// Called by SNTP (see lwipopts.h)
+void schedule_set_unix_time(uint32_t unix_time_s);
+
+#endif
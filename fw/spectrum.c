@@ -0,0 +1,209 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system spectrum analysis
+ *
+ * This component computes the magnitude spectrum of a burst of ADC samples
+ * using a fixed-point FFT, so that the frequency of the noise on the
+ * thermistor input can be found.
+ *
+ * The FFT is radix-2, in place, using complex Q15 values packed into
+ * 32-bit words (real part in the low half, imaginary part in the high half).
+ * On Cortex-M33 the DSP extension does a complex multiply in two
+ * instructions and each butterfly add/subtract in one.
+ * 
+ */
+
+#include "spectrum.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_SIMD32) && __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#define HAVE_SIMD32 1
+#else
+#define HAVE_SIMD32 0
+#endif
+
+#define INPUT_SHIFT         3       // 12-bit samples are scaled up to use the Q15 range
+
+// Twiddle factors exp(-2.pi.i.k / SPECTRUM_SIZE) for k = 0 .. SPECTRUM_SIZE / 2 - 1,
+// as packed Q15 values (see pack). Generated by:
+//   [round(cos(-2*pi*k/512)*32767) & 0xffff | (round(sin(-2*pi*k/512)*32767) & 0xffff) << 16 for k in range(256)]
+static const uint32_t g_twiddle[SPECTRUM_SIZE / 2] = {
+    0x00007fff, 0xfe6e7ffd, 0xfcdc7ff5, 0xfb4a7fe9, 0xf9b87fd8, 0xf8277fc1,
+    0xf6967fa6, 0xf5057f86, 0xf3747f61, 0xf1e47f37, 0xf0557f09, 0xeec67ed5,
+    0xed387e9c, 0xebab7e5f, 0xea1e7e1d, 0xe8927dd5, 0xe7077d89, 0xe57e7d39,
+    0xe3f57ce3, 0xe26d7c88, 0xe0e67c29, 0xdf617bc5, 0xdddd7b5c, 0xdc5a7aee,
+    0xdad87a7c, 0xd9587a05, 0xd7da7989, 0xd65d7909, 0xd4e17884, 0xd36777fa,
+    0xd1ef776b, 0xd07976d8, 0xcf057641, 0xcd9275a5, 0xcc217504, 0xcab3745f,
+    0xc94673b5, 0xc7dc7307, 0xc6747254, 0xc50e719d, 0xc3aa70e2, 0xc2487022,
+    0xc0e96f5e, 0xbf8d6e96, 0xbe326dc9, 0xbcdb6cf8, 0xbb866c23, 0xba336b4a,
+    0xb8e46a6d, 0xb797698b, 0xb64c68a6, 0xb50567bc, 0xb3c166cf, 0xb27f65dd,
+    0xb14164e8, 0xb00563ee, 0xaecd62f1, 0xad9861f0, 0xac6560eb, 0xab375fe3,
+    0xaa0b5ed7, 0xa8e35dc7, 0xa7be5cb3, 0xa69c5b9c, 0xa57e5a82, 0xa4645964,
+    0xa34d5842, 0xa239571d, 0xa12955f5, 0xa01d54c9, 0x9f15539b, 0x9e105268,
+    0x9d0f5133, 0x9c124ffb, 0x9b184ebf, 0x9a234d81, 0x99314c3f, 0x98444afb,
+    0x975a49b4, 0x96754869, 0x9593471c, 0x94b645cd, 0x93dd447a, 0x93084325,
+    0x923741ce, 0x916a4073, 0x90a23f17, 0x8fde3db8, 0x8f1e3c56, 0x8e633af2,
+    0x8dac398c, 0x8cf93824, 0x8c4b36ba, 0x8ba1354d, 0x8afc33df, 0x8a5b326e,
+    0x89bf30fb, 0x89282f87, 0x88952e11, 0x88062c99, 0x877c2b1f, 0x86f729a3,
+    0x86772826, 0x85fb26a8, 0x85842528, 0x851223a6, 0x84a42223, 0x843b209f,
+    0x83d71f1a, 0x83781d93, 0x831d1c0b, 0x82c71a82, 0x827718f9, 0x822b176e,
+    0x81e315e2, 0x81a11455, 0x816412c8, 0x812b113a, 0x80f70fab, 0x80c90e1c,
+    0x809f0c8c, 0x807a0afb, 0x805a096a, 0x803f07d9, 0x80280648, 0x801704b6,
+    0x800b0324, 0x80030192, 0x80010000, 0x8003fe6e, 0x800bfcdc, 0x8017fb4a,
+    0x8028f9b8, 0x803ff827, 0x805af696, 0x807af505, 0x809ff374, 0x80c9f1e4,
+    0x80f7f055, 0x812beec6, 0x8164ed38, 0x81a1ebab, 0x81e3ea1e, 0x822be892,
+    0x8277e707, 0x82c7e57e, 0x831de3f5, 0x8378e26d, 0x83d7e0e6, 0x843bdf61,
+    0x84a4dddd, 0x8512dc5a, 0x8584dad8, 0x85fbd958, 0x8677d7da, 0x86f7d65d,
+    0x877cd4e1, 0x8806d367, 0x8895d1ef, 0x8928d079, 0x89bfcf05, 0x8a5bcd92,
+    0x8afccc21, 0x8ba1cab3, 0x8c4bc946, 0x8cf9c7dc, 0x8dacc674, 0x8e63c50e,
+    0x8f1ec3aa, 0x8fdec248, 0x90a2c0e9, 0x916abf8d, 0x9237be32, 0x9308bcdb,
+    0x93ddbb86, 0x94b6ba33, 0x9593b8e4, 0x9675b797, 0x975ab64c, 0x9844b505,
+    0x9931b3c1, 0x9a23b27f, 0x9b18b141, 0x9c12b005, 0x9d0faecd, 0x9e10ad98,
+    0x9f15ac65, 0xa01dab37, 0xa129aa0b, 0xa239a8e3, 0xa34da7be, 0xa464a69c,
+    0xa57ea57e, 0xa69ca464, 0xa7bea34d, 0xa8e3a239, 0xaa0ba129, 0xab37a01d,
+    0xac659f15, 0xad989e10, 0xaecd9d0f, 0xb0059c12, 0xb1419b18, 0xb27f9a23,
+    0xb3c19931, 0xb5059844, 0xb64c975a, 0xb7979675, 0xb8e49593, 0xba3394b6,
+    0xbb8693dd, 0xbcdb9308, 0xbe329237, 0xbf8d916a, 0xc0e990a2, 0xc2488fde,
+    0xc3aa8f1e, 0xc50e8e63, 0xc6748dac, 0xc7dc8cf9, 0xc9468c4b, 0xcab38ba1,
+    0xcc218afc, 0xcd928a5b, 0xcf0589bf, 0xd0798928, 0xd1ef8895, 0xd3678806,
+    0xd4e1877c, 0xd65d86f7, 0xd7da8677, 0xd95885fb, 0xdad88584, 0xdc5a8512,
+    0xdddd84a4, 0xdf61843b, 0xe0e683d7, 0xe26d8378, 0xe3f5831d, 0xe57e82c7,
+    0xe7078277, 0xe892822b, 0xea1e81e3, 0xebab81a1, 0xed388164, 0xeec6812b,
+    0xf05580f7, 0xf1e480c9, 0xf374809f, 0xf505807a, 0xf696805a, 0xf827803f,
+    0xf9b88028, 0xfb4a8017, 0xfcdc800b, 0xfe6e8003,
+};
+_Static_assert(SPECTRUM_LOG2_SIZE == 9, "g_twiddle must be regenerated for this SPECTRUM_SIZE");
+
+static inline uint32_t pack(int32_t real, int32_t imag) {
+    return ((uint32_t) (uint16_t) real) | (((uint32_t) (uint16_t) imag) << 16);
+}
+
+static inline int32_t real_part(uint32_t x) {
+    return (int16_t) (x & 0xffff);
+}
+
+static inline int32_t imag_part(uint32_t x) {
+    return (int16_t) (x >> 16);
+}
+
+// Complex multiplication of Q15 values
+static inline uint32_t complex_mul(uint32_t x, uint32_t w) {
+#if HAVE_SIMD32
+    const int32_t real = __smusd((int16x2_t) x, (int16x2_t) w);     // xr.wr - xi.wi
+    const int32_t imag = __smuadx((int16x2_t) x, (int16x2_t) w);    // xr.wi + xi.wr
+#else
+    const int32_t real = (real_part(x) * real_part(w)) - (imag_part(x) * imag_part(w));
+    const int32_t imag = (real_part(x) * imag_part(w)) + (imag_part(x) * real_part(w));
+#endif
+    return pack(real >> 15, imag >> 15);
+}
+
+// (a + b) / 2 and (a - b) / 2 for both halves: scaling at each stage prevents overflow
+static inline uint32_t halving_add(uint32_t a, uint32_t b) {
+#if HAVE_SIMD32
+    return (uint32_t) __shadd16((int16x2_t) a, (int16x2_t) b);
+#else
+    return pack((real_part(a) + real_part(b)) >> 1, (imag_part(a) + imag_part(b)) >> 1);
+#endif
+}
+
+static inline uint32_t halving_sub(uint32_t a, uint32_t b) {
+#if HAVE_SIMD32
+    return (uint32_t) __shsub16((int16x2_t) a, (int16x2_t) b);
+#else
+    return pack((real_part(a) - real_part(b)) >> 1, (imag_part(a) - imag_part(b)) >> 1);
+#endif
+}
+
+static inline uint32_t magnitude_squared(uint32_t x) {
+#if HAVE_SIMD32
+    return (uint32_t) __smuad((int16x2_t) x, (int16x2_t) x);
+#else
+    return (uint32_t) ((real_part(x) * real_part(x)) + (imag_part(x) * imag_part(x)));
+#endif
+}
+
+static void bit_reverse(uint32_t* data, unsigned log2_size) {
+    const unsigned size = 1u << log2_size;
+    for (unsigned i = 0; i < size; i++) {
+        unsigned j = 0;
+        for (unsigned k = 0; k < log2_size; k++) {
+            j |= ((i >> k) & 1) << (log2_size - 1 - k);
+        }
+        if (j > i) {
+            const uint32_t tmp = data[i];
+            data[i] = data[j];
+            data[j] = tmp;
+        }
+    }
+}
+
+// In-place FFT of SPECTRUM_SIZE values, output is scaled by 1 / SPECTRUM_SIZE
+static void fft(uint32_t* data) {
+    const unsigned size = SPECTRUM_SIZE;
+    bit_reverse(data, SPECTRUM_LOG2_SIZE);
+    for (unsigned half = 1; half < size; half *= 2) {
+        const unsigned step = size / (half * 2);
+        for (unsigned j = 0; j < half; j++) {
+            // Twiddle factor exp(-i.pi.j / half)
+            const uint32_t w = g_twiddle[j * step];
+            for (unsigned i = j; i < size; i += half * 2) {
+                const uint32_t a = data[i];
+                const uint32_t t = complex_mul(data[i + half], w);
+                data[i] = halving_add(a, t);
+                data[i + half] = halving_sub(a, t);
+            }
+        }
+    }
+}
+
+uint32_t spectrum_analyse(uint32_t* data, uint32_t sample_rate_hz, void* payload, uint32_t max_size) {
+    spectrum_header_t header;
+    uint16_t magnitude[SPECTRUM_BINS];
+    if (max_size < (sizeof(header) + sizeof(magnitude))) {
+        return 0;
+    }
+
+    // Samples arrive as 16-bit values in the first half of data.
+    // Remove the mean and expand to complex values, working backwards so that
+    // no sample is overwritten before it is used.
+    const uint16_t* samples = (const uint16_t*) data;
+    uint32_t total = 0;
+    for (unsigned i = 0; i < SPECTRUM_SIZE; i++) {
+        total += samples[i] & 0xfff;
+    }
+    const int32_t mean = (int32_t) (total / SPECTRUM_SIZE);
+    for (int i = SPECTRUM_SIZE - 1; i >= 0; i--) {
+        const int32_t value = (int32_t) (samples[i] & 0xfff) - mean;
+        data[i] = pack(value << INPUT_SHIFT, 0);
+    }
+
+    fft(data);
+
+    // The input is real, so the upper half of the spectrum mirrors the lower half
+    memset(&header, 0, sizeof(header));
+    for (unsigned i = 0; i < SPECTRUM_BINS; i++) {
+        const float value = sqrtf((float) magnitude_squared(data[i]));
+        magnitude[i] = (value > (float) UINT16_MAX) ? UINT16_MAX : (uint16_t) value;
+        if ((i != 0) && (magnitude[i] > header.dominant_magnitude)) {
+            header.dominant_magnitude = magnitude[i];
+            header.dominant_bin = (uint16_t) i;
+        }
+    }
+    header.sample_rate_hz = sample_rate_hz;
+    header.num_samples = SPECTRUM_SIZE;
+    header.num_bins = SPECTRUM_BINS;
+    header.mean = (uint16_t) mean;
+    header.dominant_frequency_mhz = (uint32_t) (((uint64_t) header.dominant_bin * sample_rate_hz * 1000) / SPECTRUM_SIZE);
+
+    memcpy(payload, &header, sizeof(header));
+    memcpy(((uint8_t*) payload) + sizeof(header), magnitude, sizeof(magnitude));
+    return sizeof(header) + sizeof(magnitude);
+}
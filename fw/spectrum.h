@@ -0,0 +1,40 @@
+/*
+ * 
+ * Copyright (c) 2025 Jack Whitham
+ * 
+ * SPDX-License-Identifier: BSD-3-Clause
+ * 
+ * ventilation-system spectrum analysis
+ *
+ * This component computes the magnitude spectrum of a burst of ADC samples
+ * using a fixed-point FFT, so that the frequency of the noise on the
+ * thermistor input can be found.
+ * 
+ */
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <stdint.h>
+
+#define SPECTRUM_LOG2_SIZE      9
+#define SPECTRUM_SIZE           (1 << SPECTRUM_LOG2_SIZE)   // number of samples
+#define SPECTRUM_BINS           (SPECTRUM_SIZE / 2)         // number of frequency bins
+
+typedef struct __attribute__((packed)) spectrum_header_t {
+    uint32_t    sample_rate_hz;
+    uint16_t    num_samples;
+    uint16_t    num_bins;
+    uint16_t    mean;                   // mean ADC value
+    uint16_t    dominant_bin;           // largest bin, excluding bin 0
+    uint32_t    dominant_frequency_mhz; // frequency of dominant_bin in millihertz
+    uint16_t    dominant_magnitude;
+    uint16_t    reserved;
+} spectrum_header_t;
+
+// Computes the spectrum of SPECTRUM_SIZE 12-bit ADC samples. The samples are
+// passed in "data", which is also used as working space, so it must have room
+// for SPECTRUM_SIZE 32-bit values. The output is a spectrum_header_t followed by
+// SPECTRUM_BINS 16-bit magnitudes. Returns the output size, or 0 if max_size is too small.
+uint32_t spectrum_analyse(uint32_t* data, uint32_t sample_rate_hz, void* payload, uint32_t max_size);
+
+#endif
@@ -7,60 +7,173 @@
  * ventilation-system temperature ADC driver
  *
  * This component reads the temperature using the ADC, applies filtering
- * to reduce noise, and returns values in degrees Celsius.
+ * to reduce noise, and returns values in degrees Celsius. The sample
+ * rate can be adapted to the distance from the control thresholds.
  * 
  */
 
 #include "settings.h"
 #include "temperature.h"
+#include "spectrum.h"
+#include "packed_ring.h"
 
 #include <stdlib.h>
 #include <math.h>
-#include <string.h>
 
 #include "hardware/gpio.h"
 #include "hardware/adc.h"
+#include "hardware/dma.h"
 
 #define ADC_FULL_SCALE      (1 << 12)
-#define HISTORY_SIZE        100     // Temperatures averaged over 100 samples
+#define HISTORY_SIZE        100     // Temperatures averaged over up to 100 samples
+#define TICKS_PER_SECOND    10      // temperature_update is called every 100ms
 #define ADC_REF_VOLTAGE     3.3f
-#define MAX_REPORT_SIZE     2000
+#ifndef SAMPLE_CAPTURE_DEPTH
+#define SAMPLE_CAPTURE_DEPTH 36000  // raw samples kept for temperature_copy (1 hour at 10Hz)
+#endif
+#define ADC_CLOCK_HZ        48000000
+#define EXTERNAL_ADC_INPUT  2
+#define INTERNAL_ADC_INPUT  4
+#define MIN_BURST_RATE_HZ   1000
+#define MAX_BURST_RATE_HZ   200000
+#define DEFAULT_BURST_RATE_HZ 2000
 
 typedef struct sensor_history_t {
     int         index;
+    int         window;         // number of samples in total and total_sq
+    int         target_window;  // window grows to this size as samples arrive
     int         total;
+    uint32_t    total_sq;       // sum of squares, for the variance
     int16_t     data[HISTORY_SIZE];
 } sensor_history_t;
 
+// Sample rates for adaptive sampling, fastest first. Each rate keeps
+// the same meaning for the temperature estimate (a moving average) but
+// the window is shorter in time when sampling quickly, so that band changes
+// are detected sooner. The rate is chosen by comparing the distance from the
+// nearest threshold with the noise level: a rate is usable if the distance is
+// at least min_distance standard deviations.
+typedef struct sample_rate_t {
+    uint8_t     ticks_per_sample;
+    uint8_t     readings_per_sample;    // ADC readings averaged for each sample
+    uint8_t     window;
+    uint8_t     min_distance;
+} sample_rate_t;
+
+#define NUM_SAMPLE_RATES    4
+#define DEFAULT_SAMPLE_RATE 1       // the fixed rate used if temperature_adapt is not called
+
+static const sample_rate_t g_sample_rates[NUM_SAMPLE_RATES] = {
+    {1, 4, 25, 0},      // 10Hz, mean of 4 readings, 2.5 second window
+    {1, 1, 100, 2},     // 10Hz, 10 second window
+    {2, 1, 50, 4},      // 5Hz, 10 second window
+    {10, 1, 10, 8},     // 1Hz, 10 second window
+};
+
 typedef struct temperature_t {
     sensor_history_t    internal_sensor_history;
     sensor_history_t    external_sensor_history;
-    int16_t             report_data[MAX_REPORT_SIZE];
-    uint32_t            report_index;
+    uint8_t             rate_index;
+    uint8_t             tick_count;
+    uint16_t            hold_ticks;     // minimum time before the rate can be reduced
+    int16_t             last_external;  // most recent sample, captured on every tick
+    packed_ring_t       capture;
+    uint8_t             capture_data[PACKED_RING_BYTES(SAMPLE_CAPTURE_DEPTH)];
+    uint32_t            spectrum_data[SPECTRUM_SIZE];   // working space for temperature_spectrum
+    uint32_t            spectrum_rate_hz;               // rate of the burst in spectrum_data, 0 if none
 } temperature_t;
 
+_Static_assert((SAMPLE_CAPTURE_DEPTH % 2) == 0, "SAMPLE_CAPTURE_DEPTH must be even");
+
 
 static void update_history(sensor_history_t* sh, int16_t new_value) {
-    int16_t old_value = sh->data[sh->index];
+    // The sample leaving the window is the one "window" places before the new one,
+    // unless the window is growing, in which case no sample leaves
+    int16_t old_value = 0;
+    if (sh->window < sh->target_window) {
+        sh->window++;
+    } else {
+        int old_index = sh->index - sh->window;
+        if (old_index < 0) {
+            old_index += HISTORY_SIZE;
+        }
+        old_value = sh->data[old_index];
+    }
     sh->data[sh->index] = new_value;
     sh->total += (int) new_value - (int) old_value;
+    sh->total_sq += ((uint32_t) new_value * (uint32_t) new_value) - ((uint32_t) old_value * (uint32_t) old_value);
     sh->index++;
     if (sh->index >= HISTORY_SIZE) {
         sh->index = 0;
     }
 }
 
+static void set_history_window(sensor_history_t* sh, int window, int target_window) {
+    // Recalculate the totals over the most recent samples
+    sh->window = window;
+    sh->target_window = target_window;
+    sh->total = 0;
+    sh->total_sq = 0;
+    int index = sh->index;
+    for (int i = 0; i < window; i++) {
+        index = (index == 0) ? (HISTORY_SIZE - 1) : (index - 1);
+        const int16_t value = sh->data[index];
+        sh->total += value;
+        sh->total_sq += (uint32_t) value * (uint32_t) value;
+    }
+}
+
+static void set_sample_rate(temperature_t* t, int rate_index) {
+    const sample_rate_t* rate = &g_sample_rates[rate_index];
+    const sample_rate_t* old_rate = &g_sample_rates[t->rate_index];
+    int window = rate->window;
+    if (rate_index < (int) t->rate_index) {
+        // Speeding up: the history was sampled at the old rate, so a full window
+        // would cover a much longer time. Keep only the old samples that fall within
+        // the new window's time span, and let the window grow as new samples arrive.
+        const int span = (rate->window * rate->ticks_per_sample) / old_rate->ticks_per_sample;
+        window = t->external_sensor_history.window;
+        if (span < window) {
+            window = (span < 1) ? 1 : span;
+        }
+    }
+    t->rate_index = (uint8_t) rate_index;
+    t->tick_count = 0;
+    // Wait for the window to be refilled at the new rate before slowing down again
+    t->hold_ticks = (uint16_t) (rate->window * rate->ticks_per_sample);
+    set_history_window(&t->internal_sensor_history, window, rate->window);
+    set_history_window(&t->external_sensor_history, window, rate->window);
+}
+
+static int16_t read_adc(uint input, int readings) {
+    adc_select_input(input);
+    int total = 0;
+    for (int i = 0; i < readings; i++) {
+        total += adc_read();
+    }
+    return (int16_t) ((total + (readings / 2)) / readings);
+}
+
+static void take_sample(temperature_t* t, int readings) {
+    update_history(&t->internal_sensor_history, read_adc(INTERNAL_ADC_INPUT, readings));
+    t->last_external = read_adc(EXTERNAL_ADC_INPUT, readings);
+    update_history(&t->external_sensor_history, t->last_external);
+}
+
 void temperature_update(struct temperature_t* t) {
-    adc_select_input(4);
-    update_history(&t->internal_sensor_history, adc_read());
-    adc_select_input(2);
-    const int16_t a = adc_read();
-    update_history(&t->external_sensor_history, a);
-    if (t->report_index >= MAX_REPORT_SIZE) {
-        t->report_index = 0;
+    const sample_rate_t* rate = &g_sample_rates[t->rate_index];
+    t->tick_count++;
+    if (t->tick_count >= rate->ticks_per_sample) {
+        t->tick_count = 0;
+        // At the fastest setting, each sample is the mean of several readings taken
+        // back-to-back: this reduces ADC noise, though not interference at
+        // frequencies below the tick rate.
+        take_sample(t, rate->readings_per_sample);
     }
-    t->report_data[t->report_index] = a;
-    t->report_index++;
+    // The capture always has one sample per tick, whatever the sample rate, so
+    // that temperature_copy.py can reconstruct the times. At slower rates,
+    // the most recent sample is repeated.
+    packed_ring_append(&t->capture, (uint16_t) t->last_external);
 }
 
 struct temperature_t* temperature_init() {
@@ -77,24 +190,29 @@ struct temperature_t* temperature_init() {
     gpio_disable_pulls(ADC_PIN);
     gpio_set_input_enabled(ADC_PIN, false);
 
+    packed_ring_init(&t->capture, t->capture_data, SAMPLE_CAPTURE_DEPTH);
+
     // fill the history with the current temperature
+    t->internal_sensor_history.window = t->internal_sensor_history.target_window = HISTORY_SIZE;
+    t->external_sensor_history.window = t->external_sensor_history.target_window = HISTORY_SIZE;
     for (int i = 0; i < HISTORY_SIZE; i++) {
-        temperature_update(t);
+        take_sample(t, 1);
     }
+    set_sample_rate(t, DEFAULT_SAMPLE_RATE);
     return t;
 }
 
 float temperature_internal(const struct temperature_t* t) {
     // calculate voltage from sample value
-    const float voltage = (ADC_REF_VOLTAGE * (float) t->internal_sensor_history.total) / (float) (ADC_FULL_SCALE * HISTORY_SIZE);
+    const sensor_history_t* sh = &t->internal_sensor_history;
+    const float voltage = (ADC_REF_VOLTAGE * (float) sh->total) / (float) (ADC_FULL_SCALE * sh->window);
     // Apply the equation from the RP-2350 data sheet (section 12.4.6, "Temperature Sensor")
     // Return value in Celsius
     return 27.0f - ((voltage - 0.706f) / 0.001721f);
 }
 
-float temperature_external(const struct temperature_t* t) {
-    // sample value in 0.0 .. 1.0 range
-    const float fraction = (float) t->external_sensor_history.total / (float) (ADC_FULL_SCALE * HISTORY_SIZE);
+static float external_celsius(float fraction) {
+    // fraction is the sample value in 0.0 .. 1.0 range
     const float CtoK = 273.15f;  // return value will be in Celsius
     // Range check
     if (fraction < 0.015f) {
@@ -116,12 +234,115 @@ float temperature_external(const struct temperature_t* t) {
     return (1.0f / (A + (B * ratio))) - CtoK;
 }
 
+float temperature_external(const struct temperature_t* t) {
+    const sensor_history_t* sh = &t->external_sensor_history;
+    return external_celsius((float) sh->total / (float) (ADC_FULL_SCALE * sh->window));
+}
+
+static float external_noise(const temperature_t* t) {
+    // Standard deviation of the samples in the window, converted to Celsius
+    // at the current temperature (the thermistor response is not linear)
+    const sensor_history_t* sh = &t->external_sensor_history;
+    const float mean = (float) sh->total / (float) sh->window;
+    const float variance = ((float) sh->total_sq / (float) sh->window) - (mean * mean);
+    float sd = (variance > 0.0f) ? sqrtf(variance) : 0.0f;
+    if (sd < 1.0f) {
+        sd = 1.0f;  // at least one ADC step
+    }
+    return fabsf(external_celsius((mean + sd) / (float) ADC_FULL_SCALE)
+                - external_celsius(mean / (float) ADC_FULL_SCALE));
+}
+
+void temperature_adapt(struct temperature_t* t, float distance) {
+    // distance: Celsius between the temperature estimate and the nearest threshold
+    const float noise = external_noise(t);
+    const float z = (distance > 0.0f) ? (distance / noise) : 0.0f;
+    int target = 0;
+    while (((target + 1) < NUM_SAMPLE_RATES)
+    && (z >= (float) g_sample_rates[target + 1].min_distance)) {
+        target++;
+    }
+    if (target < (int) t->rate_index) {
+        // Approaching a threshold, or noisier: speed up immediately
+        set_sample_rate(t, target);
+    } else if ((target > (int) t->rate_index) && (t->hold_ticks == 0)) {
+        // Slow down one step at a time
+        set_sample_rate(t, t->rate_index + 1);
+    } else if (t->hold_ticks > 0) {
+        t->hold_ticks--;
+    }
+}
+
+uint32_t temperature_sample_rate(const struct temperature_t* t) {
+    const sample_rate_t* rate = &g_sample_rates[t->rate_index];
+    return TICKS_PER_SECOND / (uint32_t) rate->ticks_per_sample;
+}
+
 uint32_t temperature_copy(struct temperature_t* t, void* payload, uint32_t max_size) {
-    uint32_t size = t->report_index * 2;
-    if (size > max_size) {
-        size = max_size;
+    // Returns the oldest samples that have not been copied yet; if there are
+    // more than will fit in the payload, the rest are returned by the next call
+    return packed_ring_read(&t->capture, payload, max_size / 2) * 2;
+}
+
+uint32_t temperature_samples_lost(const struct temperature_t* t) {
+    // Samples that were overwritten before temperature_copy returned them
+    return t->capture.lost;
+}
+
+static uint32_t burst_rate(uint32_t sample_rate_hz) {
+    if (sample_rate_hz == 0) {
+        return DEFAULT_BURST_RATE_HZ;
+    } else if (sample_rate_hz < MIN_BURST_RATE_HZ) {
+        return MIN_BURST_RATE_HZ;
+    } else if (sample_rate_hz > MAX_BURST_RATE_HZ) {
+        return MAX_BURST_RATE_HZ;
+    }
+    return sample_rate_hz;
+}
+
+void temperature_spectrum_capture(struct temperature_t* t, uint32_t sample_rate_hz) {
+    sample_rate_hz = burst_rate(sample_rate_hz);
+    t->spectrum_rate_hz = 0;
+    int channel = dma_claim_unused_channel(false);
+    if (channel < 0) {
+        return;
+    }
+
+    // Capture a burst of samples from the thermistor into spectrum_data,
+    // paced by the ADC clock divider, with DMA moving each sample from the FIFO.
+    uint16_t* samples = (uint16_t*) t->spectrum_data;
+    adc_select_input(EXTERNAL_ADC_INPUT);
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(((float) ADC_CLOCK_HZ / (float) sample_rate_hz) - 1.0f);
+
+    dma_channel_config c = dma_channel_get_default_config((uint) channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, DREQ_ADC);
+    dma_channel_configure((uint) channel, &c, samples, &adc_hw->fifo, SPECTRUM_SIZE, true);
+
+    adc_run(true);
+    dma_channel_wait_for_finish_blocking((uint) channel);
+    adc_run(false);
+    adc_fifo_drain();
+
+    // Return the ADC to single-shot use for temperature_update
+    adc_fifo_setup(false, false, 0, false, false);
+    adc_set_clkdiv(0.0f);
+    dma_channel_unclaim((uint) channel);
+    t->spectrum_rate_hz = sample_rate_hz;
+}
+
+uint32_t temperature_spectrum(struct temperature_t* t, uint32_t sample_rate_hz, void* payload, uint32_t max_size) {
+    sample_rate_hz = burst_rate(sample_rate_hz);
+    if (t->spectrum_rate_hz != sample_rate_hz) {
+        return 0;
+    }
+    // The analysis overwrites the burst, so it can only be returned once
+    const uint32_t size = spectrum_analyse(t->spectrum_data, sample_rate_hz, payload, max_size);
+    if (size > 0) {
+        t->spectrum_rate_hz = 0;
     }
-    memcpy(payload, t->report_data, size);
-    t->report_index = 0;
     return size;
 }
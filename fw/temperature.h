@@ -7,7 +7,8 @@
  * ventilation-system temperature ADC driver
  *
  * This component reads the temperature using the ADC, applies filtering
- * to reduce noise, and returns values in degrees Celsius.
+ * to reduce noise, and returns values in degrees Celsius. The sample
+ * rate can be adapted to the distance from the control thresholds.
  * 
  */
 #ifndef TEMPERATURE_H
@@ -20,6 +21,14 @@ struct temperature_t* temperature_init();
 float temperature_internal(const struct temperature_t* t);
 float temperature_external(const struct temperature_t* t);
 void temperature_update(struct temperature_t* t);
+void temperature_adapt(struct temperature_t* t, float distance);
+uint32_t temperature_sample_rate(const struct temperature_t* t);
 uint32_t temperature_copy(struct temperature_t* t, void* payload, uint32_t max_size);
+uint32_t temperature_samples_lost(const struct temperature_t* t);
+// Noise spectrum: the burst capture takes up to 0.5 seconds, so it is done by the
+// main loop (temperature_spectrum_capture). temperature_spectrum then returns the
+// analysis of that burst, or 0 if no burst has been captured at that rate.
+void temperature_spectrum_capture(struct temperature_t* t, uint32_t sample_rate_hz);
+uint32_t temperature_spectrum(struct temperature_t* t, uint32_t sample_rate_hz, void* payload, uint32_t max_size);
 
 #endif
@@ -0,0 +1,81 @@
+# This Python program is an example of the use of remote_picotool
+# as a Python module providing remote procedure call (RPC) functionality.
+#
+# remote_picotool is used to call the "remote_handler_get_status" function
+# within fw/main.c with parameter 4, which captures a burst of samples from
+# the thermistor ADC at a high rate and returns their magnitude spectrum.
+# The capture is done by the device's main loop, so the request is repeated
+# until the result is ready.
+# This is a diagnostic for the ADC noise described in README.md: the
+# dominant frequency suggests where the noise comes from (e.g. 100Hz
+# would be mains ripple).
+#
+# The burst is captured into its own buffer, so the samples waiting to be
+# returned to temperature_copy.py are not affected.
+#
+# The update_secret and board_id needed to access Pico 2 W via the network
+# are loaded from remote_picotool.cfg.
+
+import argparse
+import asyncio
+import remote_picotool
+import struct
+
+ID_GET_STATUS_HANDLER = remote_picotool.ID_FIRST_USER_HANDLER + 0
+SPECTRUM_PARAMETER = 4
+SPECTRUM_PENDING = 1        # the burst is being captured: call again
+MAX_ATTEMPTS = 20
+HEADER_FORMAT = "<IHHHHIHH"
+INPUT_SHIFT = 3
+
+async def run() -> None:
+    parser = argparse.ArgumentParser(description="Get ADC noise spectrum")
+    parser.add_argument("--rate", type=int, default=2000,
+            help="sample rate in Hz (1000 to 200000)")
+    parser.add_argument("--peaks", type=int, default=5,
+            help="number of peaks to show")
+    parser.add_argument("--csv", metavar="FILE", default=None,
+            help="write the full spectrum to a CSV file")
+    args = parser.parse_args()
+
+    config = remote_picotool.RemotePicotoolCfg()
+    reader, writer = await remote_picotool.get_pico_connection(config)
+    try:
+        client = remote_picotool.Client(config.update_secret_hash, reader, writer)
+        for attempt in range(MAX_ATTEMPTS):
+            (result_data, result_value) = await client.run(ID_GET_STATUS_HANDLER,
+                    data=struct.pack("<I", args.rate), parameter=SPECTRUM_PARAMETER)
+            if result_value != SPECTRUM_PENDING:
+                break
+            await asyncio.sleep(0.2)
+    finally:
+        writer.close()
+        await writer.wait_closed()
+
+    if (result_value != 0) or (len(result_data) < struct.calcsize(HEADER_FORMAT)):
+        raise Exception(f"result value {result_value} size {len(result_data)}")
+    (sample_rate_hz, num_samples, num_bins, mean, dominant_bin,
+        dominant_frequency_mhz, dominant_magnitude, _) = struct.unpack_from(HEADER_FORMAT, result_data, 0)
+    magnitude = struct.unpack_from(f"<{num_bins}H", result_data, struct.calcsize(HEADER_FORMAT))
+
+    # The FFT output is scaled by 1 / num_samples and the input by 2 ** INPUT_SHIFT,
+    # so a sine wave with amplitude A (in ADC units) appears with magnitude A * (2 ** INPUT_SHIFT) / 2
+    def amplitude(m: int) -> float:
+        return (m * 2.0) / (2 ** INPUT_SHIFT)
+
+    bin_width = sample_rate_hz / num_samples
+    print(f"{num_samples} samples at {sample_rate_hz} Hz, resolution {bin_width:1.2f} Hz, mean ADC value {mean}")
+    print(f"Dominant frequency {dominant_frequency_mhz / 1000.0:1.2f} Hz, "
+          f"amplitude {amplitude(dominant_magnitude):1.1f} ADC units")
+    peaks = sorted(range(1, num_bins), key=lambda i: magnitude[i], reverse=True)
+    for i in peaks[:args.peaks]:
+        print(f"  {i * bin_width:8.2f} Hz  {amplitude(magnitude[i]):6.1f}")
+
+    if args.csv:
+        with open(args.csv, "wt", encoding="utf-8") as fd:
+            fd.write("frequency_hz,amplitude\n")
+            for i in range(num_bins):
+                fd.write(f"{i * bin_width:1.3f},{amplitude(magnitude[i]):1.2f}\n")
+
+if __name__ == "__main__":
+    asyncio.run(run())
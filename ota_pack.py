@@ -0,0 +1,277 @@
+# This Python program makes compressed and delta firmware images for
+# over-the-air (OTA) updates, and uploads them using remote_picotool.
+#
+#   python ota_pack.py compress build/fw/main.bin main.vota
+#   python ota_pack.py delta deployed/main.bin build/fw/main.bin main.vota
+#   python ota_pack.py upload main.vota [--activate]
+#
+# A delta image only contains the differences from the firmware that is
+# currently running (deployed/main.bin should be a copy of the main.bin
+# that was last uploaded). The firmware (fw/ota_stream.c) decodes the
+# image while it is being received and writes it to a staging area in
+# Flash. With --activate, the staged image replaces the current firmware
+# and the device is rebooted; this only happens if the staged image is
+# verified. The device replies to the activate request before it reboots.
+#
+# The format is described in fw/ota_stream.c. The update_secret and board_id
+# needed to access Pico 2 W via the network are loaded from remote_picotool.cfg.
+
+import argparse
+import asyncio
+import struct
+import sys
+import typing
+import zlib
+
+OTA_MAGIC = 0x41544f56
+OTA_VERSION = 1
+OTA_FLAG_DELTA = 1
+HEADER_FORMAT = "<IHHIIII"
+ACTIVATE_TIMEOUT = 5.0  # older firmware reboots without replying to OTA_ACTIVATE
+
+MIN_COPY = 4
+LENGTH_EXTENDED = 0x3f
+MAX_LITERAL = 64
+MAX_COPY = 1 << 16
+MAX_CANDIDATES = 16
+
+OTA_BEGIN = 0
+OTA_WRITE = 1
+OTA_FINISH = 2
+OTA_ACTIVATE = 3
+OTA_ERRORS = ["OK", "bad header", "delta does not match current firmware",
+              "image too large", "bad stream", "CRC mismatch", "bad state"]
+
+def varint(value: int) -> bytes:
+    out = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+def zigzag(value: int) -> int:
+    return (value << 1) if value >= 0 else ((-value << 1) - 1)
+
+def copy_op(kind: int, length: int, argument: int) -> bytes:
+    code = length - MIN_COPY
+    if code >= LENGTH_EXTENDED:
+        return bytes([kind | LENGTH_EXTENDED]) + varint(code - LENGTH_EXTENDED) + varint(argument)
+    return bytes([kind | code]) + varint(argument)
+
+def match_length(a: bytes, a_pos: int, b: bytes, b_pos: int, limit: int) -> int:
+    length = 0
+    while (length < limit) and (a[a_pos + length] == b[b_pos + length]):
+        length += 1
+    return length
+
+def encode(data: bytes, base: typing.Optional[bytes]) -> bytes:
+    flags = 0
+    base_size = 0
+    base_crc = 0
+    base_index: typing.Dict[bytes, typing.List[int]] = {}
+    if base is not None:
+        flags |= OTA_FLAG_DELTA
+        base_size = len(base)
+        base_crc = zlib.crc32(base)
+        for i in range(len(base) - MIN_COPY + 1):
+            base_index.setdefault(base[i:i + MIN_COPY], []).append(i)
+
+    out = bytearray(struct.pack(HEADER_FORMAT, OTA_MAGIC, OTA_VERSION, flags,
+                                len(data), zlib.crc32(data), base_size, base_crc))
+    output_index: typing.Dict[bytes, typing.List[int]] = {}
+    literals = bytearray()
+    last_delta = 0
+    pos = 0
+
+    def flush_literals() -> None:
+        for i in range(0, len(literals), MAX_LITERAL):
+            run = literals[i:i + MAX_LITERAL]
+            out.append(len(run) - 1)
+            out.extend(run)
+        literals.clear()
+
+    while pos < len(data):
+        limit = min(len(data) - pos, MAX_COPY)
+        best_length = 0
+        best_op = b""
+        best_delta: typing.Optional[int] = None
+
+        if (base is not None) and (limit >= MIN_COPY):
+            # Try the same displacement as the previous base copy first
+            candidates = [pos + last_delta]
+            candidates.extend(reversed(base_index.get(data[pos:pos + MIN_COPY], [])[-MAX_CANDIDATES:]))
+            for source in candidates:
+                if 0 <= source < len(base):
+                    length = match_length(data, pos, base, source, min(limit, len(base) - source))
+                    op = copy_op(0x80, length, zigzag(source - pos)) if length >= MIN_COPY else b""
+                    if op and ((length - len(op)) > (best_length - len(best_op))):
+                        (best_length, best_op, best_delta) = (length, op, source - pos)
+
+        if limit >= MIN_COPY:
+            for source in reversed(output_index.get(data[pos:pos + MIN_COPY], [])[-MAX_CANDIDATES:]):
+                length = match_length(data, pos, data, source, limit)
+                op = copy_op(0x40, length, pos - source)
+                if (length - len(op)) > (best_length - len(best_op)):
+                    (best_length, best_op, best_delta) = (length, op, None)
+
+        if best_length > len(best_op):
+            flush_literals()
+            out.extend(best_op)
+            if best_delta is not None:
+                last_delta = best_delta
+            step = best_length
+        else:
+            literals.append(data[pos])
+            step = 1
+
+        for i in range(pos, min(pos + step, len(data) - MIN_COPY + 1)):
+            output_index.setdefault(data[i:i + MIN_COPY], []).append(i)
+        pos += step
+
+    flush_literals()
+    return bytes(out)
+
+def decode(image: bytes, base: typing.Optional[bytes]) -> bytes:
+    # Reference decoder, matching fw/ota_stream.c
+    (magic, version, flags, output_size, output_crc,
+        base_size, base_crc) = struct.unpack_from(HEADER_FORMAT, image, 0)
+    if (magic != OTA_MAGIC) or (version != OTA_VERSION):
+        raise ValueError("not an OTA image")
+    if flags & OTA_FLAG_DELTA:
+        if (base is None) or (len(base) < base_size) or (zlib.crc32(base[:base_size]) != base_crc):
+            raise ValueError("delta does not match the base image")
+    pos = struct.calcsize(HEADER_FORMAT)
+    out = bytearray()
+
+    def read_varint() -> int:
+        nonlocal pos
+        (value, shift) = (0, 0)
+        while True:
+            byte = image[pos]
+            pos += 1
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if not (byte & 0x80):
+                return value
+
+    while len(out) < output_size:
+        op = image[pos]
+        pos += 1
+        if op < 0x40:
+            out.extend(image[pos:pos + op + 1])
+            pos += op + 1
+            continue
+        length = (op & 0x3f) + MIN_COPY
+        if (op & 0x3f) == LENGTH_EXTENDED:
+            length += read_varint()
+        argument = read_varint()
+        if op < 0x80:
+            for _ in range(length):
+                out.append(out[-argument])
+        elif op < 0xc0:
+            delta = (argument >> 1) ^ -(argument & 1)
+            source = len(out) + delta
+            out.extend(base[source:source + length])
+        else:
+            raise ValueError("bad opcode")
+    if (pos != len(image)) or (zlib.crc32(out) != output_crc):
+        raise ValueError("decoded image does not match")
+    return bytes(out)
+
+def pack(input_name: str, output_name: str, base_name: typing.Optional[str]) -> None:
+    with open(input_name, "rb") as fd:
+        data = fd.read()
+    base = None
+    if base_name is not None:
+        with open(base_name, "rb") as fd:
+            base = fd.read()
+    image = encode(data, base)
+    if decode(image, base) != data:
+        raise ValueError("OTA image did not decode correctly")
+    with open(output_name, "wb") as fd:
+        fd.write(image)
+    print(f"{output_name}: {len(data)} bytes -> {len(image)} bytes ({len(data) / len(image):1.1f}x smaller)")
+
+class OtaError(Exception):
+    pass
+
+RunFunction = typing.Callable[[bytes, int], typing.Awaitable[typing.Tuple[bytes, int]]]
+
+async def upload_image(run: RunFunction, image: bytes, activate: bool, chunk_size: int,
+                        log: typing.Callable[[str], None] = print) -> None:
+    """Sends an image to the OTA stream handler; run(data, parameter) calls the handler."""
+    header_size = struct.calcsize(HEADER_FORMAT)
+
+    def check(step: str, result_value: int) -> None:
+        if result_value != 0:
+            reason = OTA_ERRORS[result_value] if 0 <= result_value < len(OTA_ERRORS) else str(result_value)
+            raise OtaError(f"{step} failed: {reason}")
+
+    (result_data, result_value) = await run(image[:header_size], OTA_BEGIN)
+    check("begin", result_value)
+    (staging_address, ) = struct.unpack("<I", result_data[:4])
+    log(f"Staging at 0x{staging_address:08x}")
+    for offset in range(header_size, len(image), chunk_size):
+        (result_data, result_value) = await run(image[offset:offset + chunk_size], OTA_WRITE)
+        check(f"write at {offset}", result_value)
+    (result_data, result_value) = await run(b"", OTA_FINISH)
+    check("finish", result_value)
+    log("Image is staged and verified")
+    if activate:
+        try:
+            (result_data, result_value) = await asyncio.wait_for(run(b"", OTA_ACTIVATE), ACTIVATE_TIMEOUT)
+        except asyncio.TimeoutError:
+            log("No reply to activate: assuming the device is rebooting")
+            return
+        check("activate", result_value)
+
+async def upload(image_name: str, activate: bool, chunk_size: int) -> None:
+    import remote_picotool
+    ID_OTA_STREAM_HANDLER = remote_picotool.ID_FIRST_USER_HANDLER + 2
+    with open(image_name, "rb") as fd:
+        image = fd.read()
+
+    config = remote_picotool.RemotePicotoolCfg()
+    reader, writer = await remote_picotool.get_pico_connection(config)
+    try:
+        client = remote_picotool.Client(config.update_secret_hash, reader, writer)
+
+        async def run(data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+            return await client.run(ID_OTA_STREAM_HANDLER, data=data, parameter=parameter)
+
+        await upload_image(run, image, activate, chunk_size, lambda text: print(text, flush=True))
+    finally:
+        writer.close()
+        await writer.wait_closed()
+    if activate:
+        print("Rebooting with new firmware")
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Compressed and delta OTA images")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("compress", help="make a compressed image")
+    p.add_argument("input")
+    p.add_argument("output")
+    p = sub.add_parser("delta", help="make a delta image against the deployed firmware")
+    p.add_argument("base")
+    p.add_argument("input")
+    p.add_argument("output")
+    p = sub.add_parser("upload", help="upload an image")
+    p.add_argument("image")
+    p.add_argument("--activate", action="store_true", help="install the image and reboot")
+    p.add_argument("--chunk", type=int, default=2048, help="bytes per request")
+    args = parser.parse_args()
+
+    if args.command == "compress":
+        pack(args.input, args.output, None)
+    elif args.command == "delta":
+        pack(args.input, args.output, args.base)
+    else:
+        asyncio.run(upload(args.image, args.activate, args.chunk))
+
+if __name__ == "__main__":
+    main()
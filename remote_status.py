@@ -4,11 +4,17 @@
 # remote_picotool is used to call the "remote_handler_get_status" function
 # within fw/main.c, obtaining a text report of the current system status.
 #
+# With --watch, a single connection is kept open and the consolidated
+# snapshot (parameter 3, see status_snapshot.py) is polled repeatedly. After
+# the first request, only changes are transferred.
+#
 # The update_secret and board_id needed to access Pico 2 W via the network
 # are loaded from remote_picotool.cfg.
 
+import argparse
 import asyncio
 import remote_picotool
+import status_snapshot
 
 ID_GET_STATUS_HANDLER = remote_picotool.ID_FIRST_USER_HANDLER + 0
 
@@ -23,7 +29,47 @@ async def remote_handler_get_status() -> bytes:
         writer.close()
         await writer.wait_closed()
 
+async def watch(period: float, samples: bool) -> None:
+    config = remote_picotool.RemotePicotoolCfg()
+    reader, writer = await remote_picotool.get_pico_connection(config)
+    try:
+        client = remote_picotool.Client(config.update_secret_hash, reader, writer)
+        tracker = status_snapshot.SnapshotTracker(samples=samples)
+        while True:
+            (result_data, result_value) = await client.run(ID_GET_STATUS_HANDLER,
+                    data=tracker.make_request(),
+                    parameter=status_snapshot.ID_GET_STATUS_HANDLER_PARAMETER)
+            if result_value != 0:
+                raise Exception(f"result value {result_value}")
+            snapshot = tracker.update(result_data)
+            changed = (snapshot.status is not None) or (snapshot.counters is not None)
+            print(f"seq {snapshot.sequence} up {snapshot.uptime_s} "
+                    f"bytes {len(result_data)} samples {len(snapshot.samples)}"
+                    + ("" if changed else " (no change)"), flush=True)
+            if snapshot.config is not None:
+                print(f"  config {tracker.config}")
+            if snapshot.version is not None:
+                print(f"  version {tracker.version}")
+            if changed:
+                print(f"  status {tracker.status}")
+                print(f"  counters {tracker.counters}")
+                print(f"  schedule {tracker.schedule}", flush=True)
+            await asyncio.sleep(period)
+    finally:
+        writer.close()
+        await writer.wait_closed()
+
 async def run() -> None:
+    parser = argparse.ArgumentParser(description="Get ventilation system status")
+    parser.add_argument("--watch", metavar="SECONDS", type=float, default=None,
+            help="poll the status snapshot repeatedly over one connection")
+    parser.add_argument("--samples", action="store_true",
+            help="with --watch, also fetch new ADC samples (these are then not returned to temperature_copy.py)")
+    args = parser.parse_args()
+    if args.watch is not None:
+        await watch(args.watch, args.samples)
+        return
+
     result_data = await remote_handler_get_status()
     result_text = result_data.decode("utf-8", errors="ignore")
     print(result_text)
@@ -0,0 +1,47 @@
+# This Python program subscribes to the status reports sent by the
+# ventilation system, and prints each report as it arrives.
+#
+# A subscription is requested by sending "sub <seconds>" to the control
+# port (see fw/main.c). The firmware then sends each report to this
+# program until the lease expires, so the subscription is renewed
+# regularly. "unsub" is sent on exit.
+#
+# Usage: python report_subscriber.py <device address> <control port>
+
+import argparse
+import socket
+import time
+
+def run() -> None:
+    parser = argparse.ArgumentParser(description="Receive ventilation system reports")
+    parser.add_argument("address", help="IP address of the ventilation system")
+    parser.add_argument("port", type=int, help="control_port from the wifi-settings file")
+    parser.add_argument("--lease", type=int, default=600, help="lease time in seconds")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", 0))
+    destination = (args.address, args.port)
+    renew_period = max(1.0, args.lease / 2.0)
+    renew_time = 0.0
+    try:
+        while True:
+            now = time.monotonic()
+            if now >= renew_time:
+                sock.sendto(f"sub {args.lease}".encode("ascii"), destination)
+                renew_time = now + renew_period
+            sock.settimeout(renew_time - now)
+            try:
+                (data, source) = sock.recvfrom(1500)
+            except socket.timeout:
+                continue
+            text = data.decode("utf-8", errors="ignore").rstrip()
+            print(f"{time.time():1.2f} {text}", flush=True)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sock.sendto(b"unsub", destination)
+        sock.close()
+
+if __name__ == "__main__":
+    run()
@@ -0,0 +1,620 @@
+# This Python module keeps persistent remote_picotool connections to one or
+# more ventilation controllers, so that status can be polled and commands
+# sent without a new authenticated connection for every call.
+#
+# Each device has a queue of requests and several connections ("lanes"),
+# each served by its own task, so several requests to the same device are
+# in progress at once and polling is not limited to one round trip at a time.
+# The remote_picotool protocol carries one request at a time on each
+# connection, so requests cannot be pipelined on a single connection; lanes
+# are used instead, and the number of requests in progress for a device is
+# the number of lanes. Each lane is a separate authenticated session, so the
+# device must accept that many concurrent remote_picotool connections. This
+# has only been tested with the stand-in device: whether the wifi_settings
+# library (and its memory budget) on a real device allows more than one
+# session at a time has not been verified, so real devices get one lane
+# unless more are requested with --lanes (the stand-in bench uses
+# STAND_IN_LANES).
+#
+# If a connection fails, or no reply arrives within the timeout, the request
+# in progress fails with RpcError (it may or may not have been carried out)
+# and the lane closes the connection and reconnects with a backoff; other
+# requests wait in the queue for a working lane, until their timeout expires.
+#
+# Latency statistics (time from the call until the reply, including any
+# time spent waiting in the queue) are kept for each device and handler.
+#
+# The module also provides a stand-in device, which implements the
+# get-status, set-relays and OTA stream handlers of fw/main.c behind the same
+# interface as a remote_picotool connection, with a simulated network delay,
+# and can be rebooted with new firmware or settings. This is used for testing
+# without hardware (see also fleet_rollout.py --emulate):
+#
+#   python rpc_pool.py bench --stand-in 4 --lanes 4 --calls 1000 [--stall-rate 0.01]
+#   python rpc_pool.py status --repeat 10 [--lanes 2] [--id BOARD_ID ...]
+#
+# Real devices are reached using the settings in remote_picotool.cfg;
+# with --id, the board_id is replaced, and the devices must have the same
+# update_secret.
+
+import argparse
+import asyncio
+import collections
+import random
+import struct
+import time
+import typing
+import zlib
+
+import ota_pack
+import status_snapshot
+
+GET_STATUS_HANDLER = 0     # handler numbers relative to ID_FIRST_USER_HANDLER
+SET_RELAYS_HANDLER = 1
+OTA_STREAM_HANDLER = 2
+
+DEFAULT_LANES = 1
+STAND_IN_LANES = 4
+DEFAULT_TIMEOUT = 10.0
+MIN_BACKOFF = 0.5
+MAX_BACKOFF = 30.0
+MAX_LATENCY_SAMPLES = 10000
+SETTINGS_AREA_SIZE = 0x4000     # as SETTINGS_AREA_SIZE in fw/ota_stream.c
+
+Result = typing.Tuple[bytes, int]
+
+class RpcError(Exception):
+    pass
+
+class RpcTimeout(RpcError):
+    pass
+
+class Connection(typing.Protocol):
+    async def run(self, handler_id: int, data: bytes = b"", parameter: int = 0) -> Result: ...
+    async def close(self) -> None: ...
+
+class Connector(typing.Protocol):
+    first_user_handler: int
+    async def connect(self) -> Connection: ...
+
+class RemotePicotoolConnection:
+    def __init__(self, reader: typing.Any, writer: typing.Any, client: typing.Any) -> None:
+        self.reader = reader
+        self.writer = writer
+        self.client = client
+
+    async def run(self, handler_id: int, data: bytes = b"", parameter: int = 0) -> Result:
+        return await self.client.run(handler_id, data=data, parameter=parameter)
+
+    async def close(self) -> None:
+        self.writer.close()
+        try:
+            await self.writer.wait_closed()
+        except OSError:
+            pass
+
+class RemotePicotoolConnector:
+    """Connects to a Pico using remote_picotool.cfg (optionally with another board_id)."""
+
+    def __init__(self, board_id: typing.Optional[str] = None) -> None:
+        import remote_picotool
+        self.remote_picotool = remote_picotool
+        self.board_id = board_id
+        self.first_user_handler = remote_picotool.ID_FIRST_USER_HANDLER
+
+    async def connect(self) -> Connection:
+        config = self.remote_picotool.RemotePicotoolCfg()
+        if self.board_id is not None:
+            config.board_id = self.board_id
+        reader, writer = await self.remote_picotool.get_pico_connection(config)
+        client = self.remote_picotool.Client(config.update_secret_hash, reader, writer)
+        return RemotePicotoolConnection(reader, writer, client)
+
+class Stats:
+    """Latency statistics for calls, in seconds."""
+
+    def __init__(self) -> None:
+        self.calls = 0
+        self.errors = 0
+        self.timeouts = 0
+        self.latencies: typing.Deque[float] = collections.deque(maxlen=MAX_LATENCY_SAMPLES)
+
+    def add(self, latency: float) -> None:
+        self.calls += 1
+        self.latencies.append(latency)
+
+    def percentile(self, p: float) -> float:
+        if len(self.latencies) == 0:
+            return 0.0
+        ordered = sorted(self.latencies)
+        return ordered[min(len(ordered) - 1, int(p * len(ordered)))]
+
+    def summary(self) -> typing.Dict[str, float]:
+        latencies = self.latencies
+        return {
+            "calls": self.calls,
+            "errors": self.errors,
+            "timeouts": self.timeouts,
+            "min_ms": (min(latencies) * 1000.0) if latencies else 0.0,
+            "mean_ms": ((sum(latencies) * 1000.0) / len(latencies)) if latencies else 0.0,
+            "p50_ms": self.percentile(0.5) * 1000.0,
+            "p95_ms": self.percentile(0.95) * 1000.0,
+            "p99_ms": self.percentile(0.99) * 1000.0,
+            "max_ms": (max(latencies) * 1000.0) if latencies else 0.0,
+        }
+
+    def format(self) -> str:
+        s = self.summary()
+        return (f"calls {s['calls']:.0f} errors {s['errors']:.0f} timeouts {s['timeouts']:.0f} "
+                f"latency ms min {s['min_ms']:.1f} mean {s['mean_ms']:.1f} p50 {s['p50_ms']:.1f} "
+                f"p95 {s['p95_ms']:.1f} p99 {s['p99_ms']:.1f} max {s['max_ms']:.1f}")
+
+class Request(typing.NamedTuple):
+    handler_id: int
+    data: bytes
+    parameter: int
+    timeout: float
+    future: "asyncio.Future[Result]"
+
+class Device:
+    """Persistent connections to one device, with a shared queue of requests."""
+
+    def __init__(self, name: str, connector: Connector, lanes: int = DEFAULT_LANES,
+                    timeout: float = DEFAULT_TIMEOUT, max_backoff: float = MAX_BACKOFF) -> None:
+        self.name = name
+        self.connector = connector
+        self.timeout = timeout
+        self.max_backoff = max_backoff
+        self.queue: "asyncio.Queue[Request]" = asyncio.Queue()
+        self.stats = Stats()
+        self.handler_stats: typing.Dict[int, Stats] = collections.defaultdict(Stats)
+        self.connected_lanes = 0
+        self.reconnects = 0
+        self.tasks = [asyncio.create_task(self.lane()) for i in range(lanes)]
+
+    async def run(self, handler_id: int, data: bytes = b"", parameter: int = 0,
+                    timeout: typing.Optional[float] = None) -> Result:
+        future: "asyncio.Future[Result]" = asyncio.get_running_loop().create_future()
+        start_time = time.monotonic()
+        timeout = self.timeout if timeout is None else timeout
+        self.queue.put_nowait(Request(handler_id, data, parameter, timeout, future))
+        try:
+            result = await asyncio.wait_for(future, timeout)
+        except (asyncio.TimeoutError, RpcTimeout):
+            self.stats.timeouts += 1
+            self.handler_stats[handler_id].timeouts += 1
+            raise RpcTimeout(f"{self.name}: no reply from handler {handler_id}")
+        except RpcError:
+            self.stats.errors += 1
+            self.handler_stats[handler_id].errors += 1
+            raise
+        latency = time.monotonic() - start_time
+        self.stats.add(latency)
+        self.handler_stats[handler_id].add(latency)
+        return result
+
+    async def get_status(self, parameter: int = 0, data: bytes = b"") -> Result:
+        return await self.run(self.connector.first_user_handler + GET_STATUS_HANDLER,
+                                data=data, parameter=parameter)
+
+    async def set_relays(self, command: str) -> bool:
+        (result_data, result_value) = await self.run(self.connector.first_user_handler + SET_RELAYS_HANDLER,
+                                data=command.encode("utf-8"))
+        return result_value == 0
+
+    async def lane(self) -> None:
+        backoff = MIN_BACKOFF
+        while True:
+            try:
+                connection = await asyncio.wait_for(self.connector.connect(), self.timeout)
+            except Exception:
+                await asyncio.sleep(backoff * (0.5 + random.random()))
+                backoff = min(self.max_backoff, backoff * 2.0)
+                continue
+
+            backoff = MIN_BACKOFF
+            self.connected_lanes += 1
+            try:
+                while True:
+                    request = await self.queue.get()
+                    if request.future.done():
+                        continue    # caller has given up
+                    try:
+                        result = await asyncio.wait_for(connection.run(request.handler_id,
+                                    data=request.data, parameter=request.parameter), request.timeout)
+                    except asyncio.TimeoutError:
+                        # The reply may never arrive (e.g. the device rebooted), and the
+                        # connection cannot carry another request until it does
+                        if not request.future.done():
+                            request.future.set_exception(RpcTimeout(f"{self.name}: no reply, reconnecting"))
+                        break
+                    except Exception as e:
+                        if not request.future.done():
+                            request.future.set_exception(RpcError(f"{self.name}: connection failed: {e!r}"))
+                        break
+                    if not request.future.done():
+                        request.future.set_result(result)
+            finally:
+                self.connected_lanes -= 1
+                self.reconnects += 1
+                await connection.close()
+
+    async def close(self) -> None:
+        for task in self.tasks:
+            task.cancel()
+        await asyncio.gather(*self.tasks, return_exceptions=True)
+        while not self.queue.empty():
+            request = self.queue.get_nowait()
+            if not request.future.done():
+                request.future.set_exception(RpcError(f"{self.name}: closed"))
+
+class Pool:
+    """A set of devices, identified by name."""
+
+    def __init__(self, lanes: int = DEFAULT_LANES, timeout: float = DEFAULT_TIMEOUT,
+                    max_backoff: float = MAX_BACKOFF) -> None:
+        self.lanes = lanes
+        self.timeout = timeout
+        self.max_backoff = max_backoff
+        self.devices: typing.Dict[str, Device] = {}
+
+    def add(self, name: str, connector: Connector) -> Device:
+        device = Device(name, connector, self.lanes, self.timeout, self.max_backoff)
+        self.devices[name] = device
+        return device
+
+    def __getitem__(self, name: str) -> Device:
+        return self.devices[name]
+
+    async def close(self) -> None:
+        await asyncio.gather(*[device.close() for device in self.devices.values()])
+
+    async def __aenter__(self) -> "Pool":
+        return self
+
+    async def __aexit__(self, *args: typing.Any) -> None:
+        await self.close()
+
+    def report(self) -> str:
+        lines = []
+        for device in self.devices.values():
+            lines.append(f"{device.name}: {device.stats.format()}")
+            for (handler_id, stats) in sorted(device.handler_stats.items()):
+                lines.append(f"  handler {handler_id}: {stats.format()}")
+        return "\n".join(lines)
+
+# Stand-in device for testing
+
+MANUAL_COMMANDS = {
+    "piv auto": "AUTO",
+    "piv dark": "AUTO_DARK",
+    "piv on": "MANUAL_ON",
+    "piv off": "MANUAL_OFF",
+    "piv boost": "MANUAL_BOOST",
+}
+
+MANUAL_CONTROL = {
+    "AUTO": "ON",
+    "AUTO_DARK": "ON",
+    "MANUAL_ON": "ON",
+    "MANUAL_OFF": "OFF",
+    "MANUAL_BOOST": "BOOST",
+}
+
+class StandInDevice:
+    """Behaves like fw/main.c for the get-status, set-relays and OTA stream handlers.
+
+    failure_rate is the probability that a connection is reset during a call.
+    stall_rate is the probability that a reply silently never arrives: the
+    request is carried out, but the connection then hangs until it is closed.
+    With silent_activate, OTA activation reboots without replying, as older
+    firmware did; otherwise the reply is sent and the device reboots shortly after."""
+
+    FIRST_USER_HANDLER = 0x40
+    ACTIVATE_DELAY = 0.5    # ACTIVATE_DELAY_MS in fw/ota_stream.c
+    MANUAL_TIMEOUT_S = 60 * 60 * 24
+
+    def __init__(self, name: str, round_trip: float = 0.02, service_time: float = 0.002,
+                    failure_rate: float = 0.0, reboot_time: float = 2.0,
+                    firmware: bytes = b"", settings: bytes = b"",
+                    stall_rate: float = 0.0, silent_activate: bool = False) -> None:
+        self.name = name
+        self.round_trip = round_trip
+        self.service_time = service_time
+        self.failure_rate = failure_rate
+        self.stall_rate = stall_rate
+        self.silent_activate = silent_activate
+        self.reboot_time = reboot_time
+        self.firmware = firmware or bytes(random.getrandbits(8) for i in range(4096))
+        self.settings = settings
+        self.online = True
+        self.reboot_pending = False
+        self.ota_image: typing.Optional[bytearray] = None
+        self.ota_staged: typing.Optional[bytes] = None
+        self.lock = asyncio.Lock()     # the firmware handles one request at a time
+        self.handlers: typing.Dict[int, typing.Callable[[bytes, int], Result]] = {
+            self.FIRST_USER_HANDLER + GET_STATUS_HANDLER: self.get_status,
+            self.FIRST_USER_HANDLER + SET_RELAYS_HANDLER: self.set_relays,
+            self.FIRST_USER_HANDLER + OTA_STREAM_HANDLER: self.ota_stream,
+        }
+        self.boot()
+
+    async def reboot(self) -> None:
+        self.online = False
+        await asyncio.sleep(self.reboot_time)
+        self.boot()
+        self.online = True
+
+    def update_settings(self, settings: bytes) -> None:
+        # as "remote_picotool update_reboot"
+        self.settings = settings
+        asyncio.get_running_loop().create_task(self.reboot())
+
+    def boot(self) -> None:
+        self.boot_time = time.monotonic()
+        self.boot_id = random.getrandbits(32)
+        self.sequence = 1
+        self.manual_mode = "AUTO"
+        self.manual_mode_end_s = self.MANUAL_TIMEOUT_S
+        self.external_temperature = 10.0 + (random.random() * 10.0)
+        self.commands_accepted = 0
+        self.commands_rejected = 0
+        self.ota_image = None
+        self.ota_staged = None
+
+    def uptime(self) -> int:
+        return int(time.monotonic() - self.boot_time)
+
+    def make_snapshot(self, request: bytes) -> bytes:
+        snapshot = status_snapshot.Snapshot()
+        snapshot.boot_id = self.boot_id
+        snapshot.sequence = self.sequence
+        snapshot.uptime_s = self.uptime()
+        # Flags are ignored: the stand-in has no ADC samples
+        (previous_boot_id, previous_sequence, _) = struct.unpack_from(status_snapshot.REQUEST_FORMAT,
+                    request.ljust(struct.calcsize(status_snapshot.REQUEST_FORMAT), b"\0"))
+        full = (previous_boot_id != self.boot_id) or (previous_sequence == 0)
+        if full or (previous_sequence != self.sequence):
+            control = MANUAL_CONTROL[self.manual_mode]
+            snapshot.status = {
+                "external_temperature": self.external_temperature,
+                "internal_temperature": self.external_temperature + 5.0,
+                "temperature_band": "MILD",
+                "manual_mode": self.manual_mode,
+                "next_control_mode": control,
+                "current_control_mode": control,
+                "manual_mode_end_s": self.manual_mode_end_s,
+                "sample_rate_hz": 10,
+            }
+            snapshot.counters = {
+                "commands_accepted": self.commands_accepted,
+                "commands_rejected": self.commands_rejected,
+            }
+        if full:
+            snapshot.config = {"cold_threshold": 3.0, "not_cold_threshold": 4.0,
+                                "not_hot_threshold": 34.0, "hot_threshold": 35.0}
+            snapshot.version = {
+                "firmware_size": len(self.firmware),
+                "firmware_crc": zlib.crc32(self.firmware),
+                "settings_crc": zlib.crc32(settings_file(self.settings)),
+            }
+        return status_snapshot.encode(snapshot)
+
+    def get_status(self, data: bytes, parameter: int) -> Result:
+        if parameter == 0:
+            control = MANUAL_CONTROL[self.manual_mode]
+            auto = 1 if self.manual_mode.startswith("AUTO") else 0
+            text = (f"ext {self.external_temperature:1.1f} int {self.external_temperature + 5.0:1.1f} "
+                    f"control {control} auto {auto} temp MILD up {self.uptime()}\n")
+            return (text.encode("utf-8"), 0)
+        if parameter == status_snapshot.ID_GET_STATUS_HANDLER_PARAMETER:
+            return (self.make_snapshot(data), 0)
+        return (b"", 0)
+
+    def set_relays(self, data: bytes, parameter: int) -> Result:
+        command = data.decode("utf-8", errors="ignore")
+        if command not in MANUAL_COMMANDS:
+            self.commands_rejected += 1
+            return (b"", 1)
+        self.manual_mode = MANUAL_COMMANDS[command]
+        self.manual_mode_end_s = self.uptime() + self.MANUAL_TIMEOUT_S
+        self.commands_accepted += 1
+        self.sequence += 1
+        return (b"", 0)
+
+    def ota_stream(self, data: bytes, parameter: int) -> Result:
+        # Same results as ota_result_t in fw/ota_stream.h
+        if parameter == ota_pack.OTA_BEGIN:
+            self.ota_image = None
+            self.ota_staged = None
+            header_size = struct.calcsize(ota_pack.HEADER_FORMAT)
+            if len(data) < header_size:
+                return (b"", 1)
+            (magic, version, flags, output_size, output_crc,
+                base_size, base_crc) = struct.unpack_from(ota_pack.HEADER_FORMAT, data, 0)
+            if (magic != ota_pack.OTA_MAGIC) or (version != ota_pack.OTA_VERSION):
+                return (b"", 1)
+            if (flags & ota_pack.OTA_FLAG_DELTA) and (zlib.crc32(self.firmware[:base_size]) != base_crc):
+                return (b"", 2)
+            self.ota_image = bytearray(data[:header_size])
+            return (struct.pack("<I", 0x10000000 + 0x100000), 0)
+        if parameter == ota_pack.OTA_WRITE:
+            if self.ota_image is None:
+                return (b"", 6)
+            self.ota_image += data
+            return (b"", 0)
+        if parameter == ota_pack.OTA_FINISH:
+            if self.ota_image is None:
+                return (b"", 6)
+            try:
+                self.ota_staged = ota_pack.decode(bytes(self.ota_image), self.firmware)
+            except (ValueError, IndexError):
+                self.ota_image = None
+                return (b"", 5)
+            return (b"", 0)
+        if parameter == ota_pack.OTA_ACTIVATE:
+            if self.ota_staged is None:
+                return (b"", 6)
+            self.firmware = self.ota_staged
+            self.ota_staged = None
+            if self.silent_activate:
+                self.reboot_pending = True
+            else:
+                asyncio.get_running_loop().call_later(self.ACTIVATE_DELAY,
+                            lambda: asyncio.get_running_loop().create_task(self.reboot()))
+            return (b"", 0)
+        return (b"", 6)
+
+def settings_file(data: bytes) -> bytes:
+    # The part of a wifi-settings file that the firmware includes in its CRC
+    data = data[:SETTINGS_AREA_SIZE]
+    for (i, byte) in enumerate(data):
+        if byte in (0x00, 0xff):
+            return data[:i]
+    return data
+
+class StandInConnection:
+    def __init__(self, device: StandInDevice) -> None:
+        self.device = device
+        self.boot_id = device.boot_id
+        self.closed = False
+
+    def lost(self) -> bool:
+        # connections do not survive a reboot
+        return self.closed or (not self.device.online) or (self.boot_id != self.device.boot_id)
+
+    async def run(self, handler_id: int, data: bytes = b"", parameter: int = 0) -> Result:
+        device = self.device
+        await asyncio.sleep(device.round_trip / 2.0)
+        if self.lost() or (random.random() < device.failure_rate):
+            self.closed = True
+            raise ConnectionResetError("stand-in connection reset")
+        async with device.lock:
+            await asyncio.sleep(device.service_time)
+            handler = device.handlers.get(handler_id)
+            result = handler(data, parameter) if handler else (b"", -1)
+            if device.reboot_pending:
+                # the device reboots without replying
+                device.reboot_pending = False
+                asyncio.get_running_loop().create_task(device.reboot())
+                await self.stall()
+            elif random.random() < device.stall_rate:
+                await self.stall()
+        await asyncio.sleep(device.round_trip / 2.0)
+        if self.lost():
+            raise ConnectionResetError("stand-in connection reset")
+        return result
+
+    async def stall(self) -> None:
+        # Nothing arrives, and as with TCP, nothing indicates that the
+        # device has gone away until the client gives up
+        while not self.closed:
+            await asyncio.sleep(0.1)
+        raise ConnectionResetError("stand-in connection closed")
+
+    async def close(self) -> None:
+        self.closed = True
+
+class StandInConnector:
+    def __init__(self, device: StandInDevice) -> None:
+        self.device = device
+        self.first_user_handler = StandInDevice.FIRST_USER_HANDLER
+
+    async def connect(self) -> Connection:
+        # Authentication takes a few round trips
+        await asyncio.sleep(self.device.round_trip * 3.0)
+        if not self.device.online:
+            raise ConnectionRefusedError("stand-in device is offline")
+        return StandInConnection(self.device)
+
+# Command line
+
+async def bench(num_devices: int, lanes: int, calls: int, round_trip: float, failure_rate: float,
+                stall_rate: float, timeout: float) -> None:
+    async with Pool(lanes=lanes, timeout=timeout) as pool:
+        for i in range(num_devices):
+            device = StandInDevice(f"stand-in-{i}", round_trip=round_trip, failure_rate=failure_rate,
+                                    stall_rate=stall_rate)
+            pool.add(device.name, StandInConnector(device))
+
+        num_deltas = 0
+
+        async def poll(device: Device) -> None:
+            nonlocal num_deltas
+            tracker = status_snapshot.SnapshotTracker()
+            remaining = calls
+
+            async def worker() -> None:
+                # Each request is made when it is sent, after the previous reply
+                # has updated the tracker, so that most calls are deltas
+                nonlocal remaining, num_deltas
+                while remaining > 0:
+                    remaining -= 1
+                    try:
+                        if (remaining % 10) == 0:
+                            await device.set_relays(random.choice(list(MANUAL_COMMANDS)))
+                        if tracker.previous is not None:
+                            num_deltas += 1
+                        (data, result) = await device.get_status(status_snapshot.ID_GET_STATUS_HANDLER_PARAMETER,
+                                                                 tracker.make_request())
+                    except RpcError:
+                        continue
+                    if len(data) > 0:
+                        tracker.update(data)
+
+            await asyncio.gather(*[worker() for i in range(lanes)])
+
+        start_time = time.monotonic()
+        await asyncio.gather(*[poll(device) for device in pool.devices.values()])
+        elapsed = time.monotonic() - start_time
+        total = sum(device.stats.calls for device in pool.devices.values())
+        print(pool.report())
+        print(f"{num_deltas} of {num_devices * calls} status requests were deltas")
+        print(f"{total} calls in {elapsed:1.2f}s ({total / elapsed:1.0f} per second); "
+              f"one call at a time would take about {total * (round_trip + 0.002) / num_devices:1.2f}s")
+
+async def status(board_ids: typing.List[typing.Optional[str]], lanes: int, repeat: int, period: float) -> None:
+    async with Pool(lanes=lanes) as pool:
+        for board_id in board_ids:
+            pool.add(board_id or "default", RemotePicotoolConnector(board_id))
+        for i in range(repeat):
+            devices = list(pool.devices.values())
+            results = await asyncio.gather(*[device.get_status() for device in devices],
+                                            return_exceptions=True)
+            for (device, result) in zip(devices, results):
+                if isinstance(result, BaseException):
+                    print(f"{device.name}: {result}")
+                else:
+                    print(f"{device.name}: {result[0].decode('utf-8', errors='ignore').strip()}")
+            if (i + 1) < repeat:
+                await asyncio.sleep(period)
+        print(pool.report())
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Persistent pipelined RPC connections")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("bench", help="measure throughput against stand-in devices")
+    p.add_argument("--stand-in", type=int, default=1, help="number of stand-in devices")
+    p.add_argument("--lanes", type=int, default=STAND_IN_LANES, help="connections per device")
+    p.add_argument("--calls", type=int, default=200, help="status calls per device")
+    p.add_argument("--round-trip-ms", type=float, default=20.0, help="simulated network round trip")
+    p.add_argument("--failure-rate", type=float, default=0.0, help="probability of a connection reset per call")
+    p.add_argument("--stall-rate", type=float, default=0.0, help="probability that a reply never arrives")
+    p.add_argument("--timeout", type=float, default=DEFAULT_TIMEOUT, help="seconds to wait for a reply")
+    p = sub.add_parser("status", help="poll the text status of real devices")
+    p.add_argument("--id", action="append", default=None, help="board_id (may be repeated)")
+    p.add_argument("--lanes", type=int, default=DEFAULT_LANES,
+            help="connections per device (more than one is not verified on real devices)")
+    p.add_argument("--repeat", type=int, default=1, help="number of polls")
+    p.add_argument("--period", type=float, default=1.0, help="seconds between polls")
+    args = parser.parse_args()
+
+    if args.command == "bench":
+        asyncio.run(bench(args.stand_in, args.lanes, args.calls,
+                          args.round_trip_ms / 1000.0, args.failure_rate,
+                          args.stall_rate, args.timeout))
+    else:
+        asyncio.run(status(args.id or [None], args.lanes, args.repeat, args.period))
+
+if __name__ == "__main__":
+    main()
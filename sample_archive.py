@@ -0,0 +1,494 @@
+# This Python program stores thermistor ADC samples (as downloaded by
+# temperature_copy.py) in a compact binary archive, and queries the archive
+# for a time window, either returning every sample or downsampling to
+# min/max/mean values so that long periods can be plotted quickly.
+#
+#   python sample_archive.py convert temp_log.txt samples.vsa
+#   python sample_archive.py info samples.vsa
+#   python sample_archive.py query samples.vsa --start 1718000000000 --end 1718086400000 --step-ms 60000
+#   python sample_archive.py reindex samples.vsa
+#
+# Times are milliseconds since the Unix epoch.
+#
+# The archive is a sequence of blocks. Each block holds up to BLOCK_SAMPLES
+# samples taken at a regular interval, so only the time of the first sample
+# and the interval are stored. The 12-bit samples are stored relative to the
+# smallest sample in the block, using only as many bits as are needed for the
+# largest difference (typically 6-8 bits, as the temperature changes slowly
+# and most of the variation is noise). The block header also has the minimum,
+# maximum and total of the samples, so a downsampled query does not need to
+# decode blocks that fall entirely within one output interval.
+#
+# A sidecar index file (<archive>.idx) has a fixed-size record for each block,
+# giving its time range and position. It is searched by binary search with
+# both files memory-mapped. The index can be rebuilt from the archive. Only
+# appending (or reindex) removes a partly-written block from the end of the
+# archive; info and query never change it.
+
+import argparse
+import bisect
+import mmap
+import os
+import struct
+import sys
+import typing
+import zlib
+
+FILE_MAGIC = b"VSAM"
+FILE_VERSION = 1
+FILE_HEADER_FORMAT = "<4sHH"
+BLOCK_MAGIC = b"VSAB"
+BLOCK_HEADER_FORMAT = "<4sqIHHHBBII"
+INDEX_RECORD_FORMAT = "<qqQ"
+
+BLOCK_SAMPLES = 4096
+SAMPLE_BITS = 12
+DEFAULT_TOLERANCE_MS = 10
+
+FILE_HEADER_SIZE = struct.calcsize(FILE_HEADER_FORMAT)
+BLOCK_HEADER_SIZE = struct.calcsize(BLOCK_HEADER_FORMAT)
+INDEX_RECORD_SIZE = struct.calcsize(INDEX_RECORD_FORMAT)
+
+Sample = typing.Tuple[int, int]                     # time_ms, value
+Bucket = typing.Tuple[int, int, int, float, int]    # time_ms, min, max, mean, count
+
+class ArchiveError(Exception):
+    pass
+
+class BlockHeader(typing.NamedTuple):
+    start_ms: int
+    period_ms: int
+    count: int
+    minimum: int
+    maximum: int
+    bits: int
+    total: int
+    crc: int
+
+    @property
+    def end_ms(self) -> int:
+        return self.start_ms + ((self.count - 1) * self.period_ms)
+
+    @property
+    def payload_size(self) -> int:
+        return ((self.count * self.bits) + 7) // 8
+
+def index_name(archive_name: str) -> str:
+    return archive_name + ".idx"
+
+def pack_values(values: typing.Sequence[int], base: int, bits: int) -> bytes:
+    out = bytearray()
+    acc = 0
+    acc_bits = 0
+    for value in values:
+        acc |= (value - base) << acc_bits
+        acc_bits += bits
+        while acc_bits >= 8:
+            out.append(acc & 0xff)
+            acc >>= 8
+            acc_bits -= 8
+    if acc_bits > 0:
+        out.append(acc & 0xff)
+    return bytes(out)
+
+def unpack_values(payload: bytes, count: int, base: int, bits: int) -> typing.List[int]:
+    if bits == 0:
+        return [base] * count
+    values = []
+    mask = (1 << bits) - 1
+    acc = 0
+    acc_bits = 0
+    pos = 0
+    for i in range(count):
+        while acc_bits < bits:
+            acc |= payload[pos] << acc_bits
+            pos += 1
+            acc_bits += 8
+        values.append(base + (acc & mask))
+        acc >>= bits
+        acc_bits -= bits
+    return values
+
+def encode_block(start_ms: int, period_ms: int, values: typing.Sequence[int]) -> bytes:
+    for value in values:
+        if not (0 <= value < (1 << SAMPLE_BITS)):
+            raise ArchiveError(f"sample value {value} is out of range")
+    minimum = min(values)
+    maximum = max(values)
+    bits = (maximum - minimum).bit_length()
+    payload = pack_values(values, minimum, bits)
+    header = struct.pack(BLOCK_HEADER_FORMAT, BLOCK_MAGIC, start_ms, period_ms,
+            len(values), minimum, maximum, bits, 0, sum(values), zlib.crc32(payload))
+    return header + payload
+
+def decode_block_header(data: typing.Any, offset: int) -> BlockHeader:
+    if (offset + BLOCK_HEADER_SIZE) > len(data):
+        raise ArchiveError(f"block header at {offset} is truncated")
+    (magic, start_ms, period_ms, count, minimum, maximum, bits, reserved,
+        total, crc) = struct.unpack_from(BLOCK_HEADER_FORMAT, data, offset)
+    if magic != BLOCK_MAGIC:
+        raise ArchiveError(f"bad block magic number at {offset}")
+    if (count == 0) or (bits > SAMPLE_BITS):
+        raise ArchiveError(f"bad block header at {offset}")
+    return BlockHeader(start_ms, period_ms, count, minimum, maximum, bits, total, crc)
+
+def decode_block(data: typing.Any, offset: int) -> typing.Tuple[BlockHeader, typing.List[int]]:
+    header = decode_block_header(data, offset)
+    start = offset + BLOCK_HEADER_SIZE
+    payload = bytes(data[start:start + header.payload_size])
+    if len(payload) != header.payload_size:
+        raise ArchiveError(f"block at {offset} is truncated")
+    if zlib.crc32(payload) != header.crc:
+        raise ArchiveError(f"block at {offset} has a bad CRC")
+    return (header, unpack_values(payload, header.count, header.minimum, header.bits))
+
+class ArchiveWriter:
+    """Appends samples to an archive, creating it if necessary.
+
+    Samples must be added in time order. Samples are collected into a block
+    until the block is full, or a sample does not fit the regular interval
+    of the block (within tolerance_ms), or flush() is called."""
+
+    def __init__(self, archive_name: str, tolerance_ms: int = DEFAULT_TOLERANCE_MS) -> None:
+        self.tolerance_ms = tolerance_ms
+        self.times: typing.List[int] = []
+        self.values: typing.List[int] = []
+        self.last_ms: typing.Optional[int] = None
+        if (not os.path.exists(archive_name)) or (os.path.getsize(archive_name) == 0):
+            with open(archive_name, "wb") as fd:
+                fd.write(struct.pack(FILE_HEADER_FORMAT, FILE_MAGIC, FILE_VERSION, FILE_HEADER_SIZE))
+            with open(index_name(archive_name), "wb"):
+                pass
+        else:
+            if not index_is_valid(archive_name):
+                rebuild_index(archive_name, repair=True)
+            reader = ArchiveReader(archive_name)
+            self.last_ms = reader.end_ms()
+            reader.close()
+        self.data_fd = open(archive_name, "ab")
+        self.index_fd = open(index_name(archive_name), "ab")
+
+    def add(self, time_ms: int, value: int) -> None:
+        if (self.last_ms is not None) and (time_ms < self.last_ms):
+            raise ArchiveError(f"sample at {time_ms} is earlier than the previous sample")
+        self.last_ms = time_ms
+        if len(self.times) >= 2:
+            period_ms = self.times[1] - self.times[0]
+            expected_ms = self.times[0] + (len(self.times) * period_ms)
+            if abs(time_ms - expected_ms) > self.tolerance_ms:
+                self.flush()
+        elif (len(self.times) == 1) and (time_ms == self.times[0]):
+            # a zero interval only describes a single sample
+            self.flush()
+        self.times.append(time_ms)
+        self.values.append(value)
+        if len(self.times) >= BLOCK_SAMPLES:
+            self.flush()
+
+    def flush(self) -> None:
+        if len(self.times) == 0:
+            return
+        start_ms = self.times[0]
+        period_ms = (self.times[1] - start_ms) if len(self.times) >= 2 else 0
+        block = encode_block(start_ms, period_ms, self.values)
+        offset = self.data_fd.tell()
+        self.data_fd.write(block)
+        self.data_fd.flush()
+        end_ms = start_ms + ((len(self.times) - 1) * period_ms)
+        self.index_fd.write(struct.pack(INDEX_RECORD_FORMAT, start_ms, end_ms, offset))
+        self.index_fd.flush()
+        self.times = []
+        self.values = []
+
+    def close(self) -> None:
+        self.flush()
+        self.data_fd.close()
+        self.index_fd.close()
+
+    def __enter__(self) -> "ArchiveWriter":
+        return self
+
+    def __exit__(self, *args: typing.Any) -> None:
+        self.close()
+
+class IndexEndTimes:
+    """Sequence view of the end times in the index, for bisect."""
+
+    def __init__(self, index: typing.Any, num_blocks: int) -> None:
+        self.index = index
+        self.num_blocks = num_blocks
+
+    def __len__(self) -> int:
+        return self.num_blocks
+
+    def __getitem__(self, i: int) -> int:
+        (start_ms, end_ms, offset) = struct.unpack_from(INDEX_RECORD_FORMAT, self.index, i * INDEX_RECORD_SIZE)
+        return end_ms
+
+def rebuild_index(archive_name: str, repair: bool = False) -> int:
+    """Rebuild the index by scanning the archive. Returns the number of blocks.
+    A partly-written block at the end of the archive (from an interrupted
+    append) is left out of the index, and removed if repair is set. Any other
+    damage raises ArchiveError without changing the archive."""
+    with open(archive_name, "r+b" if repair else "rb") as fd:
+        data = fd.read()
+        check_file_header(data)
+        records = bytearray()
+        offset = FILE_HEADER_SIZE
+        num_blocks = 0
+        while offset < len(data):
+            try:
+                (header, values) = decode_block(data, offset)
+            except ArchiveError:
+                if not block_is_torn(data, offset):
+                    raise
+                if repair:
+                    print(f"{archive_name}: truncated at {offset} (was {len(data)} bytes)", file=sys.stderr)
+                    fd.truncate(offset)
+                else:
+                    print(f"{archive_name}: ignoring partly-written block at {offset}", file=sys.stderr)
+                break
+            records += struct.pack(INDEX_RECORD_FORMAT, header.start_ms, header.end_ms, offset)
+            offset += BLOCK_HEADER_SIZE + header.payload_size
+            num_blocks += 1
+    with open(index_name(archive_name), "wb") as fd:
+        fd.write(records)
+    return num_blocks
+
+def block_is_torn(data: typing.Any, offset: int) -> bool:
+    # A block is torn if the archive ends before the length given by its
+    # header, which happens only to the last block of an interrupted append
+    if (offset + BLOCK_HEADER_SIZE) > len(data):
+        return True
+    try:
+        header = decode_block_header(data, offset)
+    except ArchiveError:
+        return False
+    return (offset + BLOCK_HEADER_SIZE + header.payload_size) > len(data)
+
+def check_file_header(data: typing.Any) -> None:
+    if len(data) < FILE_HEADER_SIZE:
+        raise ArchiveError("archive is too short")
+    (magic, version, header_size) = struct.unpack_from(FILE_HEADER_FORMAT, data, 0)
+    if magic != FILE_MAGIC:
+        raise ArchiveError("not a sample archive")
+    if version != FILE_VERSION:
+        raise ArchiveError(f"unsupported archive version {version}")
+
+class ArchiveReader:
+    """Memory-maps an archive and its index for queries."""
+
+    def __init__(self, archive_name: str) -> None:
+        if not index_is_valid(archive_name):
+            rebuild_index(archive_name)
+        self.data_fd = open(archive_name, "rb")
+        self.index_fd = open(index_name(archive_name), "rb")
+        self.data = mmap.mmap(self.data_fd.fileno(), 0, access=mmap.ACCESS_READ)
+        check_file_header(self.data)
+        index_size = os.fstat(self.index_fd.fileno()).st_size
+        self.num_blocks = index_size // INDEX_RECORD_SIZE
+        self.index: typing.Any = b""
+        if self.num_blocks > 0:
+            self.index = mmap.mmap(self.index_fd.fileno(), 0, access=mmap.ACCESS_READ)
+        self.end_times = IndexEndTimes(self.index, self.num_blocks)
+
+    def close(self) -> None:
+        if self.num_blocks > 0:
+            self.index.close()
+        self.data.close()
+        self.data_fd.close()
+        self.index_fd.close()
+
+    def __enter__(self) -> "ArchiveReader":
+        return self
+
+    def __exit__(self, *args: typing.Any) -> None:
+        self.close()
+
+    def record(self, i: int) -> typing.Tuple[int, int, int]:
+        return struct.unpack_from(INDEX_RECORD_FORMAT, self.index, i * INDEX_RECORD_SIZE)
+
+    def start_ms(self) -> typing.Optional[int]:
+        return self.record(0)[0] if self.num_blocks > 0 else None
+
+    def end_ms(self) -> typing.Optional[int]:
+        return self.record(self.num_blocks - 1)[1] if self.num_blocks > 0 else None
+
+    def blocks(self, start_ms: int, end_ms: int) -> typing.Iterator[int]:
+        """Offsets of blocks that may contain samples in [start_ms, end_ms)."""
+        i = bisect.bisect_left(self.end_times, start_ms)
+        while i < self.num_blocks:
+            (block_start_ms, block_end_ms, offset) = self.record(i)
+            if block_start_ms >= end_ms:
+                break
+            yield offset
+            i += 1
+
+    def samples(self, start_ms: int, end_ms: int) -> typing.Iterator[Sample]:
+        for offset in self.blocks(start_ms, end_ms):
+            (header, values) = decode_block(self.data, offset)
+            for (i, value) in enumerate(values):
+                time_ms = header.start_ms + (i * header.period_ms)
+                if start_ms <= time_ms < end_ms:
+                    yield (time_ms, value)
+
+    def downsample(self, start_ms: int, end_ms: int, step_ms: int) -> typing.Iterator[Bucket]:
+        """Min/max/mean for each interval of step_ms, starting at start_ms.
+        Intervals without samples are omitted."""
+        bucket_ms: typing.Optional[int] = None
+        minimum = maximum = total = count = 0
+
+        def add(time_ms: int, block_min: int, block_max: int, block_total: int, block_count: int) -> typing.Optional[Bucket]:
+            nonlocal bucket_ms, minimum, maximum, total, count
+            this_bucket_ms = start_ms + (((time_ms - start_ms) // step_ms) * step_ms)
+            result = None
+            if this_bucket_ms != bucket_ms:
+                if bucket_ms is not None:
+                    result = (bucket_ms, minimum, maximum, total / count, count)
+                bucket_ms = this_bucket_ms
+                (minimum, maximum, total, count) = (block_min, block_max, 0, 0)
+            minimum = min(minimum, block_min)
+            maximum = max(maximum, block_max)
+            total += block_total
+            count += block_count
+            return result
+
+        for offset in self.blocks(start_ms, end_ms):
+            header = decode_block_header(self.data, offset)
+            first_bucket = (header.start_ms - start_ms) // step_ms
+            last_bucket = (header.end_ms - start_ms) // step_ms
+            if ((header.start_ms >= start_ms) and (header.end_ms < end_ms)
+            and (first_bucket == last_bucket)):
+                # whole block is within one interval: use the header
+                done = add(header.start_ms, header.minimum, header.maximum, header.total, header.count)
+                if done is not None:
+                    yield done
+                continue
+            (header, values) = decode_block(self.data, offset)
+            for (i, value) in enumerate(values):
+                time_ms = header.start_ms + (i * header.period_ms)
+                if start_ms <= time_ms < end_ms:
+                    done = add(time_ms, value, value, value, 1)
+                    if done is not None:
+                        yield done
+        if (bucket_ms is not None) and (count > 0):
+            yield (bucket_ms, minimum, maximum, total / count, count)
+
+def index_is_valid(archive_name: str) -> bool:
+    # The index is valid if it has whole records and the last record
+    # refers to the last block in the archive
+    name = index_name(archive_name)
+    if not os.path.exists(name):
+        return False
+    index_size = os.path.getsize(name)
+    archive_size = os.path.getsize(archive_name)
+    if (index_size % INDEX_RECORD_SIZE) != 0:
+        return False
+    if index_size == 0:
+        return archive_size == FILE_HEADER_SIZE
+    with open(name, "rb") as fd:
+        fd.seek(index_size - INDEX_RECORD_SIZE)
+        (start_ms, end_ms, offset) = struct.unpack(INDEX_RECORD_FORMAT, fd.read(INDEX_RECORD_SIZE))
+    with open(archive_name, "rb") as fd:
+        fd.seek(offset)
+        try:
+            header = decode_block_header(fd.read(BLOCK_HEADER_SIZE), 0)
+        except ArchiveError:
+            return False
+    return (offset + BLOCK_HEADER_SIZE + header.payload_size) == archive_size
+
+def convert(log_name: str, archive_name: str, tolerance_ms: int) -> None:
+    num_samples = 0
+    num_skipped = 0
+    with ArchiveWriter(archive_name, tolerance_ms) as writer:
+        with open(log_name, "rt", encoding="utf-8") as fd:
+            for line in fd:
+                fields = line.split()
+                if len(fields) != 2:
+                    continue
+                time_ms = round(float(fields[0]) * 1000.0)
+                if (writer.last_ms is not None) and (time_ms < writer.last_ms):
+                    # The archive must be in time order; a log may not be, e.g.
+                    # if the computer's clock was set back during a download
+                    num_skipped += 1
+                    continue
+                writer.add(time_ms, int(fields[1]))
+                num_samples += 1
+    if num_skipped > 0:
+        print(f"{log_name}: skipped {num_skipped} samples that were earlier than the previous sample")
+    log_size = os.path.getsize(log_name)
+    archive_size = os.path.getsize(archive_name) + os.path.getsize(index_name(archive_name))
+    print(f"{archive_name}: {num_samples} samples, {log_size} bytes -> {archive_size} bytes "
+            f"({log_size / max(1, archive_size):1.1f}x smaller)")
+
+def info(archive_name: str) -> None:
+    with ArchiveReader(archive_name) as reader:
+        num_samples = 0
+        payload_bits = 0
+        for i in range(reader.num_blocks):
+            header = decode_block_header(reader.data, reader.record(i)[2])
+            num_samples += header.count
+            payload_bits += header.count * header.bits
+        print(f"blocks: {reader.num_blocks}")
+        print(f"samples: {num_samples}")
+        print(f"bytes: {len(reader.data)}")
+        if num_samples > 0:
+            print(f"time: {reader.start_ms()} .. {reader.end_ms()}")
+            print(f"bits per sample: {payload_bits / num_samples:1.2f} "
+                    f"(with headers {(len(reader.data) * 8) / num_samples:1.2f})")
+
+def query(archive_name: str, start_ms: typing.Optional[int], end_ms: typing.Optional[int],
+            step_ms: typing.Optional[int], csv: bool) -> None:
+    separator = "," if csv else " "
+    with ArchiveReader(archive_name) as reader:
+        if reader.num_blocks == 0:
+            return
+        if start_ms is None:
+            start_ms = typing.cast(int, reader.start_ms())
+        if end_ms is None:
+            end_ms = typing.cast(int, reader.end_ms()) + 1
+        if step_ms is None:
+            if csv:
+                print("time_ms,value")
+            for sample in reader.samples(start_ms, end_ms):
+                print(separator.join(str(x) for x in sample))
+        else:
+            if csv:
+                print("time_ms,min,max,mean,count")
+            for (time_ms, minimum, maximum, mean, count) in reader.downsample(start_ms, end_ms, step_ms):
+                print(separator.join([str(time_ms), str(minimum), str(maximum), f"{mean:1.2f}", str(count)]))
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Binary archive of thermistor ADC samples")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("convert", help="convert a temp_log.txt file (appending to the archive)")
+    p.add_argument("log")
+    p.add_argument("archive")
+    p.add_argument("--tolerance-ms", type=int, default=DEFAULT_TOLERANCE_MS,
+            help="allowed deviation from the regular sample interval")
+    p = sub.add_parser("info", help="summarise an archive")
+    p.add_argument("archive")
+    p = sub.add_parser("query", help="print samples within a time window")
+    p.add_argument("archive")
+    p.add_argument("--start", type=int, default=None, help="start time (ms since the epoch)")
+    p.add_argument("--end", type=int, default=None, help="end time (ms since the epoch, exclusive)")
+    p.add_argument("--step-ms", type=int, default=None,
+            help="print min/max/mean for each interval rather than every sample")
+    p.add_argument("--csv", action="store_true", help="print CSV with a heading")
+    p = sub.add_parser("reindex", help="rebuild the index file, removing a partly-written block at the end")
+    p.add_argument("archive")
+    args = parser.parse_args()
+
+    if args.command == "convert":
+        convert(args.log, args.archive, args.tolerance_ms)
+    elif args.command == "info":
+        info(args.archive)
+    elif args.command == "query":
+        if (args.step_ms is not None) and (args.step_ms <= 0):
+            parser.error("--step-ms must be positive")
+        query(args.archive, args.start, args.end, args.step_ms, args.csv)
+    else:
+        print(f"{args.archive}: {rebuild_index(args.archive, repair=True)} blocks")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,246 @@
+# This Python module decodes the consolidated status snapshot returned by
+# the "remote_handler_get_status" function within fw/main.c when it is
+# called with parameter 3.
+#
+# A snapshot is a header followed by a sequence of sections. Each section
+# has a type and a size, so sections that are not recognised can be skipped,
+# and sections may grow (new fields are added at the end).
+#
+# A client may request only the changes since a previous snapshot by passing
+# the boot_id and sequence number from that snapshot as the input data
+# (see make_request). If nothing has changed, the response contains only the
+# header. New ADC samples are only included if the request asks for them
+# (REQUEST_SAMPLES), because the samples that are sent are removed from the
+# capture buffer on the device.
+
+import struct
+import typing
+
+ID_GET_STATUS_HANDLER_PARAMETER = 3
+
+SNAPSHOT_MAGIC = 0x504e5356
+SNAPSHOT_VERSION = 1
+
+SECTION_STATUS = 1
+SECTION_CONFIG = 2
+SECTION_COUNTERS = 3
+SECTION_SAMPLES = 4
+SECTION_SCHEDULE = 5
+SECTION_VERSION = 6
+
+HEADER_FORMAT = "<IHHIII"
+SECTION_HEADER_FORMAT = "<HH"
+REQUEST_FORMAT = "<III"
+REQUEST_SAMPLES = 1 << 0
+
+TEMPERATURE_BANDS = ["COLD", "MILD", "HOT"]
+MANUAL_MODES = ["AUTO", "AUTO_DARK", "MANUAL_OFF", "MANUAL_ON", "MANUAL_BOOST"]
+CONTROL_MODES = ["OFF", "ON", "BOOST"]
+
+STATUS_FIELDS = [
+    ("external_temperature", "h", 0.1),
+    ("internal_temperature", "h", 0.1),
+    ("temperature_band", "B", TEMPERATURE_BANDS),
+    ("manual_mode", "B", MANUAL_MODES),
+    ("next_control_mode", "B", CONTROL_MODES),
+    ("current_control_mode", "B", CONTROL_MODES),
+    ("manual_mode_end_s", "I", None),
+    ("sample_rate_hz", "H", None),
+]
+
+CONFIG_FIELDS = [
+    ("cold_threshold", "h", 0.1),
+    ("not_cold_threshold", "h", 0.1),
+    ("not_hot_threshold", "h", 0.1),
+    ("hot_threshold", "h", 0.1),
+    ("change_delay_s", "I", None),
+    ("report_interval_s", "I", None),
+    ("manual_timeout_s", "I", None),
+    ("report_addr", "4s", "ipv4"),
+    ("report_port", "H", None),
+    ("control_port", "H", None),
+    ("report_deadband", "h", 0.1),
+    ("report_heartbeat_s", "I", None),
+]
+
+COUNTERS_FIELDS = [
+    ("reports_sent", "I", None),
+    ("commands_accepted", "I", None),
+    ("commands_rejected", "I", None),
+    ("control_changes", "I", None),
+    ("report_datagrams_sent", "I", None),
+    ("subscribers", "I", None),
+    ("subscriptions_expired", "I", None),
+    ("reports_suppressed", "I", None),
+    ("samples_lost", "I", None),
+]
+
+SCHEDULE_FIELDS = [
+    ("unix_time", "I", None),
+    ("next_transition", "I", None),
+    ("active_rule", "b", None),
+    ("num_rules", "B", None),
+]
+
+VERSION_FIELDS = [
+    ("firmware_size", "I", None),
+    ("firmware_crc", "I", None),        # CRC-32 of main.bin
+    ("settings_crc", "I", None),        # CRC-32 of the wifi-settings file
+]
+
+Fields = typing.List[typing.Tuple[str, str, typing.Any]]
+
+class SnapshotError(Exception):
+    pass
+
+class Snapshot:
+    def __init__(self) -> None:
+        self.boot_id = 0
+        self.sequence = 0
+        self.uptime_s = 0
+        self.status: typing.Optional[typing.Dict[str, typing.Any]] = None
+        self.config: typing.Optional[typing.Dict[str, typing.Any]] = None
+        self.counters: typing.Optional[typing.Dict[str, typing.Any]] = None
+        self.schedule: typing.Optional[typing.Dict[str, typing.Any]] = None
+        self.version: typing.Optional[typing.Dict[str, typing.Any]] = None
+        self.samples: typing.List[int] = []
+
+def make_request(previous: typing.Optional[Snapshot], samples: bool = False) -> bytes:
+    flags = REQUEST_SAMPLES if samples else 0
+    if previous is None:
+        return struct.pack(REQUEST_FORMAT, 0, 0, flags) if flags else b""
+    return struct.pack(REQUEST_FORMAT, previous.boot_id, previous.sequence, flags)
+
+def decode_fields(fields: Fields, data: bytes) -> typing.Dict[str, typing.Any]:
+    result: typing.Dict[str, typing.Any] = {}
+    offset = 0
+    for (name, fmt, conversion) in fields:
+        size = struct.calcsize("<" + fmt)
+        if (offset + size) > len(data):
+            # Field not present (older firmware)
+            break
+        (value, ) = struct.unpack_from("<" + fmt, data, offset)
+        offset += size
+        if isinstance(conversion, float):
+            value = value * conversion
+        elif isinstance(conversion, list):
+            value = conversion[value] if value < len(conversion) else str(value)
+        elif conversion == "ipv4":
+            value = ".".join(str(x) for x in value)
+        result[name] = value
+    return result
+
+def encode_fields(fields: Fields, values: typing.Dict[str, typing.Any]) -> bytes:
+    # Inverse of decode_fields; missing values are zero
+    result = b""
+    for (name, fmt, conversion) in fields:
+        value = values.get(name, 0)
+        if isinstance(conversion, float):
+            value = round(value / conversion)
+        elif isinstance(conversion, list):
+            value = conversion.index(value) if value in conversion else int(value)
+        elif conversion == "ipv4":
+            value = bytes(int(x) for x in str(value or "0.0.0.0").split("."))
+        result += struct.pack("<" + fmt, value)
+    return result
+
+def encode(snapshot: Snapshot) -> bytes:
+    """Makes a snapshot in the format sent by the firmware (used by test devices)."""
+    header_size = struct.calcsize(HEADER_FORMAT)
+    data = struct.pack(HEADER_FORMAT, SNAPSHOT_MAGIC, SNAPSHOT_VERSION, header_size,
+            snapshot.boot_id, snapshot.sequence, snapshot.uptime_s)
+    sections: typing.List[typing.Tuple[int, bytes]] = []
+    if snapshot.status is not None:
+        sections.append((SECTION_STATUS, encode_fields(STATUS_FIELDS, snapshot.status)))
+    if snapshot.counters is not None:
+        sections.append((SECTION_COUNTERS, encode_fields(COUNTERS_FIELDS, snapshot.counters)))
+    if snapshot.schedule is not None:
+        sections.append((SECTION_SCHEDULE, encode_fields(SCHEDULE_FIELDS, snapshot.schedule)))
+    if snapshot.config is not None:
+        sections.append((SECTION_CONFIG, encode_fields(CONFIG_FIELDS, snapshot.config)))
+    if snapshot.version is not None:
+        sections.append((SECTION_VERSION, encode_fields(VERSION_FIELDS, snapshot.version)))
+    if len(snapshot.samples) > 0:
+        sections.append((SECTION_SAMPLES, struct.pack(f"<{len(snapshot.samples)}h", *snapshot.samples)))
+    for (section_type, section) in sections:
+        data += struct.pack(SECTION_HEADER_FORMAT, section_type, len(section)) + section
+    return data
+
+def decode(data: bytes) -> Snapshot:
+    header_size = struct.calcsize(HEADER_FORMAT)
+    if len(data) < header_size:
+        raise SnapshotError("snapshot is too short")
+    (magic, version, actual_header_size, boot_id,
+        sequence, uptime_s) = struct.unpack_from(HEADER_FORMAT, data, 0)
+    if magic != SNAPSHOT_MAGIC:
+        raise SnapshotError(f"bad snapshot magic number 0x{magic:x}")
+    if version != SNAPSHOT_VERSION:
+        raise SnapshotError(f"unsupported snapshot version {version}")
+
+    snapshot = Snapshot()
+    snapshot.boot_id = boot_id
+    snapshot.sequence = sequence
+    snapshot.uptime_s = uptime_s
+
+    section_header_size = struct.calcsize(SECTION_HEADER_FORMAT)
+    offset = actual_header_size
+    while (offset + section_header_size) <= len(data):
+        (section_type, section_size) = struct.unpack_from(SECTION_HEADER_FORMAT, data, offset)
+        offset += section_header_size
+        section = data[offset:offset + section_size]
+        offset += section_size
+        if len(section) != section_size:
+            raise SnapshotError("snapshot section is truncated")
+
+        if section_type == SECTION_STATUS:
+            snapshot.status = decode_fields(STATUS_FIELDS, section)
+        elif section_type == SECTION_CONFIG:
+            snapshot.config = decode_fields(CONFIG_FIELDS, section)
+        elif section_type == SECTION_COUNTERS:
+            snapshot.counters = decode_fields(COUNTERS_FIELDS, section)
+        elif section_type == SECTION_SCHEDULE:
+            snapshot.schedule = decode_fields(SCHEDULE_FIELDS, section)
+        elif section_type == SECTION_VERSION:
+            snapshot.version = decode_fields(VERSION_FIELDS, section)
+        elif section_type == SECTION_SAMPLES:
+            count = section_size // 2
+            snapshot.samples = list(struct.unpack(f"<{count}h", section[:count * 2]))
+
+    return snapshot
+
+class SnapshotTracker:
+    """Keeps the most recent complete state, applying delta snapshots to it."""
+
+    def __init__(self, samples: bool = False) -> None:
+        self.samples = samples
+        self.previous: typing.Optional[Snapshot] = None
+        self.status: typing.Dict[str, typing.Any] = {}
+        self.config: typing.Dict[str, typing.Any] = {}
+        self.counters: typing.Dict[str, typing.Any] = {}
+        self.schedule: typing.Dict[str, typing.Any] = {}
+        self.version: typing.Dict[str, typing.Any] = {}
+
+    def make_request(self) -> bytes:
+        return make_request(self.previous, self.samples)
+
+    def update(self, data: bytes) -> Snapshot:
+        snapshot = decode(data)
+        if (self.previous is not None) and (snapshot.boot_id != self.previous.boot_id):
+            # Device restarted: a full snapshot will have been sent
+            self.status = {}
+            self.config = {}
+            self.counters = {}
+            self.schedule = {}
+            self.version = {}
+        if snapshot.status is not None:
+            self.status = snapshot.status
+        if snapshot.config is not None:
+            self.config = snapshot.config
+        if snapshot.counters is not None:
+            self.counters = snapshot.counters
+        if snapshot.schedule is not None:
+            self.schedule = snapshot.schedule
+        if snapshot.version is not None:
+            self.version = snapshot.version
+        self.previous = snapshot
+        return snapshot
@@ -1,53 +1,97 @@
 # This Python program is an example of the use of remote_picotool
 # as a Python module providing remote procedure call (RPC) functionality.
 #
-# Every 120 seconds, remote_picotool is used to call 
+# Every 30 minutes, remote_picotool is used to call 
 # the "remote_handler_get_status" function within fw/main.c
-# to download up to 2000 samples from the thermistor ADC (which
-# is sampling the temperature 10 times each second).
+# to download the new samples from the thermistor ADC (which
+# is sampling the temperature 10 times each second). The firmware
+# keeps the most recent samples (1 hour by default, set by SAMPLE_CAPTURE_DEPTH
+# in fw/CMakeLists.txt), so the period must be shorter than this.
+# Each request returns as many samples as will fit, so requests are
+# repeated until a response is not full.
 # This data was used to produce img/graph.png.
 #
+# The samples are appended to temp_log.txt, or with --archive, to a
+# binary archive that can be queried with sample_archive.py.
+#
 # The update_secret and board_id needed to access Pico 2 W via the network
 # are loaded from remote_picotool.cfg.
 
 
+import argparse
 import asyncio
 import remote_picotool
+import sample_archive
 import time
 import struct
+import typing
 
 ID_GET_STATUS_HANDLER = remote_picotool.ID_FIRST_USER_HANDLER + 0
 
 async def run() -> None:
+    parser = argparse.ArgumentParser(description="Download thermistor ADC samples")
+    parser.add_argument("--archive", metavar="FILE", default=None,
+            help="append to a binary sample archive instead of temp_log.txt")
+    parser.add_argument("--period", metavar="SECONDS", type=float, default=1800.0,
+            help="time between downloads")
+    args = parser.parse_args()
+
     capture_period = 0.1
-    download_period = 120.0
+    download_period = args.period
     previous_end_time = 0.0
     config = remote_picotool.RemotePicotoolCfg()
+    archive: typing.Optional[sample_archive.ArchiveWriter] = None
+    if args.archive is not None:
+        archive = sample_archive.ArchiveWriter(args.archive)
+        if archive.last_ms is not None:
+            # the archive must stay in time order, so continue after its last sample
+            previous_end_time = (archive.last_ms / 1000.0) + capture_period
     reader, writer = await remote_picotool.get_pico_connection(config)
     try:
         client = remote_picotool.Client(config.update_secret_hash, reader, writer)
-        with open("temp_log.txt", "at", encoding="utf-8") as fd:
+        while True:
+            request_time = time.time() 
+            result_data = b""
+            max_chunk_size = 0
             while True:
-                request_time = time.time() 
-                (result_data, result_value) = await client.run(ID_GET_STATUS_HANDLER, parameter = 2)
+                chunk_time = time.time()
+                (chunk, result_value) = await client.run(ID_GET_STATUS_HANDLER, parameter = 2)
                 if result_value != 0:
                     raise Exception(f"result value {result_value}")
-                if len(result_data) & 1:
+                if len(chunk) & 1:
                     raise Exception("result data size is odd")
-                report_size = len(result_data) // 2
-                report_start_time = max(request_time - (report_size * capture_period), previous_end_time)
-                print(f"Got {report_size} items starting at {report_start_time:1.2f}", flush=True)
-                for (i, item) in enumerate(struct.unpack(f"<{report_size}H", result_data)):
-                    t = report_start_time + (i * capture_period)
-                    fd.write(f"{t:1.2f} {item:d}\n")
+                if len(chunk) == 0:
+                    break
+                # the last sample was taken shortly before the last non-empty response
+                result_data += chunk
+                request_time = chunk_time
+                # a chunk smaller than the largest one means the device had no
+                # more samples; a new sample arrives every 100ms, so waiting for
+                # an empty response may never end on a slow connection
+                if len(chunk) < max_chunk_size:
+                    break
+                max_chunk_size = len(chunk)
+            report_size = len(result_data) // 2
+            report_start_time = max(request_time - (report_size * capture_period), previous_end_time)
+            print(f"Got {report_size} items starting at {report_start_time:1.2f}", flush=True)
+            items = struct.unpack(f"<{report_size}H", result_data)
+            if archive is not None:
+                for (i, item) in enumerate(items):
+                    archive.add(round((report_start_time + (i * capture_period)) * 1000.0), item)
+                archive.flush()
+            else:
+                with open("temp_log.txt", "at", encoding="utf-8") as fd:
+                    for (i, item) in enumerate(items):
+                        fd.write(f"{report_start_time + (i * capture_period):1.2f} {item:d}\n")
 
-                previous_end_time = report_start_time + (report_size * capture_period)
-                fd.flush()
-                await asyncio.sleep(download_period)
+            previous_end_time = report_start_time + (report_size * capture_period)
+            await asyncio.sleep(download_period)
 
     except KeyboardInterrupt:
         pass
     finally:
+        if archive is not None:
+            archive.close()
         writer.close()
         await writer.wait_closed()
 